@@ -15,8 +15,26 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <ctype.h> //isspace() 
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#endif
+
+#include "tokenizer.h"
 
  /* To avoid security error on Visual Studio */
 #define _CRT_SECURE_NO_WARNINGS
@@ -25,32 +43,38 @@
 #define MAX_NR_TOKENS 32	/* Maximum number of tokens in a command */
 #define MAX_TOKEN_LEN 64	/* Maximum length of single token */
 #define MAX_COMMAND	256		/* Maximum length of command string */
+#define STREAM_CHUNK (1 << 20)	/* Bytes to read from a stream at once */
+#define PARALLEL_CHUNK (1 << 20)	/* Bytes of input per parallel work item */
+#define OUTPUT_FLUSH (1 << 20)	/* Bytes of output to buffer with -b */
 
 /***********************************************************************
- * parse_command(command, nr_tokens, tokens)
+ * parse_command(command, len, nr_tokens, tokens)
  *
  * DESCRIPTION
- *	Parse @command, and put each command token into @tokens[] and the number of
- *	tokes into @nr_tokens.
+ *	Parse the first @len characters of @command, and put the location of each
+ *	command token into @tokens[] and the number of tokens into @nr_tokens.
  *
  *  A command token is defined as a string without any whitespace (i.e., *space*
  *  and *tab* in this programming assignment) in the middle. For exmaple,
  *    command = "  Hello world   Ajou   University!!  "
  *
  *  then, the command can be split into four command tokens, which are;
- *   tokens[0] = "Hello"
- *   tokens[1] = "world"
- *   tokens[2] = "Ajou"
- *   tokens[3] = "University!!"
+ *   tokens[0] = { 2, 5 }     "Hello"
+ *   tokens[1] = { 8, 5 }     "world"
+ *   tokens[2] = { 16, 4 }    "Ajou"
+ *   tokens[3] = { 23, 12 }   "University!!"
  *
  *  Accordingly, nr_tokens should be 4. Another exmaple is;
  *   command = "  add r0   r1 r2 "
  *
  *  then, nr_tokens = 4, and tokens are
- *   tokens[0] = "add"
- *   tokens[1] = "r0"
- *   tokens[2] = "r1"
- *   tokens[3] = "r2"
+ *   tokens[0] = { 2, 3 }     "add"
+ *   tokens[1] = { 6, 2 }     "r0"
+ *   tokens[2] = { 11, 2 }    "r1"
+ *   tokens[3] = { 14, 2 }    "r2"
+ *
+ *  @command is left untouched and does not need to be NUL-terminated. At most
+ *  MAX_NR_TOKENS tokens are reported; the rest of the command is ignored.
  *
  *
  * RESTRICTION
@@ -62,104 +86,634 @@
  *	Return 0 after filling in @nr_tokens and @tokens[] properly
  *
  */
-static int parse_command(char* command, int* nr_tokens, char* tokens[])
-{
-	/* TODO
-	 * Followings are example code. You should delete them and implement
-	 * your own code here
-	 */
-
-	 // nr_tokens ū  Ҵ
-	 // tokens[] ū ڿ Ҵ
-
-	int cmdIndex = 0; //command ε
-	int tokIndex = 0; //tokens ε
-	int firstPoint = 0; //command 迭 ū ε  ġ
-	int endPoint = 0; //command 迭 ū ε  ġ
-	static char resultStr[MAX_TOKEN_LEN] = { '\0' }; //  ڿ = ū
-
-	int cmdLen = 0; //command 
-	while (command[cmdLen] != '\0') cmdLen++; //command ̸ Ѵ.
-
-	for (; cmdIndex < cmdLen; cmdIndex++) {
-		if (isspace(command[cmdIndex]) == 0) { // ƴ ڸ  -> ū 
-			firstPoint = cmdIndex; //ū ó ġ صд.
-
-			for (; cmdIndex < cmdLen; ++cmdIndex) { //ؼ command ĵ
-				if (isspace(command[cmdIndex]) != 0) { // ڸ  -> ū 
-					endPoint = cmdIndex; //ū  ġ صд.
-
-					//  ̱̾
-					int strIndex = 0; //ū ڿ ε
-
-					//command ε  ڸ  迭 ε ´.
-					for (int i = firstPoint; i < endPoint; i++, strIndex++) {
-						resultStr[strIndex] = command[i];
-
-						//printf("---->>>>>>>>>>>>myCharcat----  strIndex / i : %d / %d\n", strIndex, i);
-						//printf("---->>>>>>>>>>>>myCharcat---- resultStr : %s\n", resultStr);
-					}
-					resultStr[strIndex] = '\0'; // ιڸ ־ν ڿ ϼѴ.
-
-					int strLen = 0; //resultStr 
-					while (resultStr[strLen] != '\0') strLen++; //resultStr ̸ Ѵ.
-
-					tokens[tokIndex] = (char*)malloc(sizeof(char) * (strLen + 1)); // ޸ Ҵ
-
-					// ū ڿ tokens[] ޸𸮷 Ѵ.
-					int x = 0;
-					while (x < strLen + 1) {
-						tokens[tokIndex][x] = resultStr[x];
-						x++;
-					}
-					//strcpy(tokens[tokIndex], resultStr); // ū ڿ tokens[] ޸𸮷 Ѵ.
-					//tokens[tokIndex] = resultStr; // ū ڿ tokens[] ҴѴ.
-					//printf("---->>>>>>>>>>>>[[[[[[[[myCharcat---- tokens[tokIndex] : %s\n", tokens[tokIndex]);
-
-					tokIndex++;
-					break;
-				}
-				else continue;
-			}
-		}
-		else continue;
+static int parse_command_scalar(const char* command, size_t len, int* nr_tokens, struct token_span tokens[])
+{
+	size_t cmdIndex = 0; //command index
+	int tokIndex = 0; //tokens index
+
+	while (cmdIndex < len && tokIndex < MAX_NR_TOKENS) {
+		size_t firstPoint;
+
+		while (cmdIndex < len && isspace((unsigned char)command[cmdIndex])) cmdIndex++;
+		if (cmdIndex == len) break;
+
+		firstPoint = cmdIndex; //a token starts here
+		while (cmdIndex < len && !isspace((unsigned char)command[cmdIndex])) cmdIndex++;
+
+		tokens[tokIndex].offset = (unsigned int)firstPoint;
+		tokens[tokIndex].len = (unsigned int)(cmdIndex - firstPoint);
+		tokIndex++;
 	}
-	*nr_tokens = tokIndex; //tokIndex  ū  ȴ.
+	*nr_tokens = tokIndex;
+
+	return 0;
+}
+
+/* Classify whitespace 16 or 32 bytes at a time when the CPU supports it */
+static int parse_command(const char* command, size_t len, int* nr_tokens, struct token_span tokens[])
+{
+	if (!tokenizer_has_simd())
+		return parse_command_scalar(command, len, nr_tokens, tokens);
+
+	*nr_tokens = tokenize_spans(command, len, tokens, MAX_NR_TOKENS);
 
 	return 0;
 }
 
 
 /***********************************************************************
- * The main function of this program. DO NOT CHANGE THE CODE BELOW
+ * Statistics of a run, reported at exit when the -s option is given
  */
-int main(int argc, char* const argv[])
+struct parse_stats {
+	unsigned long long nr_lines;
+	unsigned long long nr_tokens;
+	unsigned long long nr_bytes;
+};
+
+static double now_sec(void)
 {
-	char line[MAX_COMMAND] = { '\0' };
-	FILE* input = stdin;
+	struct timespec ts;
 
-	if (argc == 2) {
-		input = fopen(argv[1], "r");
-		if (!input) {
-			fprintf(stderr, "No input file %s\n", argv[1]);
-			return -EINVAL;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Peak resident set size of this process in KB, or -1 if unknown */
+static long peak_rss_kb(void)
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return -1;
+	return (long)(pmc.PeakWorkingSetSize / 1024);
+#else
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage)) return -1;
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;	/* bytes on macOS */
+#else
+	return usage.ru_maxrss;
+#endif
+#endif
+}
+
+static void print_stats(const struct parse_stats* stats, double elapsed)
+{
+	if (elapsed <= 0) elapsed = 1e-9;
+
+	fprintf(stderr, "# %llu lines, %llu tokens, %llu bytes in %.3f sec\n",
+		stats->nr_lines, stats->nr_tokens, stats->nr_bytes, elapsed);
+	fprintf(stderr, "# %.0f tokens/sec, %.1f MB/sec, peak RSS %ld KB\n",
+		stats->nr_tokens / elapsed, stats->nr_bytes / elapsed / (1 << 20), peak_rss_kb());
+}
+
+
+/***********************************************************************
+ * process_line(line, len, stats)
+ *
+ * DESCRIPTION
+ *   Tokenize @line of @len characters (including its '\n', if any) and
+ *   print the tokens found in it.
+ */
+static void process_line(const char* line, size_t len, struct parse_stats* stats)
+{
+	struct token_span tokens[MAX_NR_TOKENS];
+	int nr_tokens;
+
+	parse_command(line, len, &nr_tokens, tokens);
+
+	fprintf(stderr, "nr_tokens = %d\n", nr_tokens);
+	for (int i = 0; i < nr_tokens; i++) {
+		fprintf(stderr, "tokens[%d] = %.*s\n", i, (int)tokens[i].len, line + tokens[i].offset);
+	}
+	printf("\n");
+
+	stats->nr_lines++;
+	stats->nr_tokens += nr_tokens;
+	stats->nr_bytes += len;
+}
+
+/**
+ * A growable text buffer. It is reused from chunk to chunk, so it stops
+ * allocating once it has grown to the size of the largest chunk.
+ */
+struct outbuf {
+	char* buf;
+	size_t len;
+	size_t size;
+};
+
+static int outbuf_reserve(struct outbuf* out, size_t more)
+{
+	size_t size = out->size ? out->size : 4096;
+	char* buf;
+
+	if (out->len + more <= out->size) return 0;
+
+	while (size < out->len + more) size *= 2;
+	buf = realloc(out->buf, size);
+	if (!buf) return -ENOMEM;
+
+	out->buf = buf;
+	out->size = size;
+	return 0;
+}
+
+static inline char* put_uint(char* p, unsigned int value)
+{
+	char digits[10];
+	int nr = 0;
+
+	do {
+		digits[nr++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	while (nr) *p++ = digits[--nr];
+	return p;
+}
+
+/**
+ * Same as process_line(), but appends the text that process_line() would
+ * print to stderr to @out
+ */
+static int format_line(const char* line, size_t len, struct outbuf* out, struct parse_stats* stats)
+{
+	struct token_span tokens[MAX_NR_TOKENS];
+	int nr_tokens;
+	char* p;
+
+	parse_command(line, len, &nr_tokens, tokens);
+
+	/* "nr_tokens = NN\n" plus "tokens[NN] = \n" and the token per token */
+	if (outbuf_reserve(out, 16 + len + 16 * nr_tokens)) return -ENOMEM;
+
+	p = out->buf + out->len;
+	memcpy(p, "nr_tokens = ", 12);
+	p = put_uint(p + 12, nr_tokens);
+	*p++ = '\n';
+	for (int i = 0; i < nr_tokens; i++) {
+		memcpy(p, "tokens[", 7);
+		p = put_uint(p + 7, i);
+		memcpy(p, "] = ", 4);
+		memcpy(p + 4, line + tokens[i].offset, tokens[i].len);
+		p += 4 + tokens[i].len;
+		*p++ = '\n';
+	}
+	out->len = p - out->buf;
+
+	stats->nr_lines++;
+	stats->nr_tokens += nr_tokens;
+	stats->nr_bytes += len;
+
+	return 0;
+}
+
+/* Write @nr_lines empty lines to stdout, as process_line() does per line */
+static void print_newlines(unsigned long long nr_lines)
+{
+	static const char newlines[] =
+		"\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n"
+		"\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n";
+
+	while (nr_lines) {
+		size_t nr = nr_lines < sizeof(newlines) - 1 ? (size_t)nr_lines : sizeof(newlines) - 1;
+
+		fwrite(newlines, 1, nr, stdout);
+		nr_lines -= nr;
+	}
+}
+
+
+#ifndef _WIN32
+/***********************************************************************
+ * Parallel tokenization
+ *
+ * The input is cut into chunks of about PARALLEL_CHUNK bytes at line
+ * boundaries. Worker threads tokenize the chunks and format their output
+ * into per-chunk buffers, while the main thread writes the buffers out in
+ * the order of the chunks. Hence the output is identical to the one from
+ * process_line(). There are twice as many chunk slots as workers so that the
+ * workers can go ahead while the main thread is writing.
+ */
+struct chunk {
+	const char* buf;
+	size_t len;
+	int done;
+	int error;
+	struct outbuf out;
+	struct parse_stats stats;
+};
+
+struct worker_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* Broadcast on every change below */
+
+	int nr_threads;
+	pthread_t* threads;
+
+	int nr_slots;
+	struct chunk* slots;
+
+	/* Sequence numbers of the chunks; next_write <= next_take <= next_cut */
+	unsigned long next_cut;
+	unsigned long next_take;
+	unsigned long next_write;
+	int quit;
+};
+
+static struct worker_pool* pool = NULL;
+
+static void* pool_worker(void* arg)
+{
+	struct worker_pool* p = arg;
+
+	pthread_mutex_lock(&p->lock);
+	while (1) {
+		struct chunk* c;
+		const char* line;
+		const char* end;
+
+		while (p->next_take == p->next_cut && !p->quit) {
+			pthread_cond_wait(&p->cond, &p->lock);
 		}
+		if (p->next_take == p->next_cut) break;
+
+		c = &p->slots[p->next_take++ % p->nr_slots];
+		pthread_mutex_unlock(&p->lock);
+
+		c->out.len = 0;
+		memset(&c->stats, 0, sizeof(c->stats));
+		for (line = c->buf, end = c->buf + c->len; line < end && !c->error; ) {
+			const char* newline = memchr(line, '\n', end - line);
+			const char* next = newline ? newline + 1 : end;
+
+			c->error = format_line(line, next - line, &c->out, &c->stats);
+			line = next;
+		}
+
+		pthread_mutex_lock(&p->lock);
+		c->done = 1;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+static struct worker_pool* pool_create(int nr_threads)
+{
+	struct worker_pool* p = calloc(1, sizeof(*p));
+
+	if (!p) return NULL;
+
+	p->nr_slots = nr_threads * 2;
+	p->slots = calloc(p->nr_slots, sizeof(*p->slots));
+	p->threads = calloc(nr_threads, sizeof(*p->threads));
+	if (!p->slots || !p->threads) goto out_free;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	/* The workers only read the classifier this picks */
+	tokenizer_select();
+
+	for (p->nr_threads = 0; p->nr_threads < nr_threads; p->nr_threads++) {
+		if (pthread_create(&p->threads[p->nr_threads], NULL, pool_worker, p)) break;
 	}
+	if (p->nr_threads) return p;
 
-	while (fgets(line, sizeof(line), input)) {
-		char* tokens[MAX_NR_TOKENS] = { NULL };
-		int nr_tokens;
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+out_free:
+	free(p->threads);
+	free(p->slots);
+	free(p);
+	return NULL;
+}
 
-		parse_command(line, &nr_tokens, tokens);
+static void pool_destroy(struct worker_pool* p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	for (int i = 0; i < p->nr_threads; i++) {
+		pthread_join(p->threads[i], NULL);
+	}
+	for (int i = 0; i < p->nr_slots; i++) {
+		free(p->slots[i].out.buf);
+	}
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p->threads);
+	free(p->slots);
+	free(p);
+}
 
-		fprintf(stderr, "nr_tokens = %d\n", nr_tokens);
-		for (int i = 0; i < nr_tokens; i++) {
-			fprintf(stderr, "tokens[%d] = %s\n", i, tokens[i]);
+/***********************************************************************
+ * pool_process_lines(p, buf, len, stats)
+ *
+ * DESCRIPTION
+ *   Cut @buf into chunks for the workers of @p and write out their results
+ *   in order. Returns once all lines in @buf are written.
+ *
+ * RETURN VALUE
+ *   0 on success, -ENOMEM if a worker ran out of memory
+ */
+static int pool_process_lines(struct worker_pool* p, const char* buf, size_t len, struct parse_stats* stats)
+{
+	size_t pos = 0;
+	int ret = 0;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->next_write < p->next_cut || pos < len) {
+		struct chunk* c;
+
+		if (pos < len && !ret && p->next_cut - p->next_write < (unsigned long)p->nr_slots) {
+			size_t end = len - pos > PARALLEL_CHUNK ? pos + PARALLEL_CHUNK : len;
+			const char* newline = memchr(buf + end - 1, '\n', len - end + 1);
+
+			if (newline) end = newline - buf + 1;
+			else end = len;
+
+			c = &p->slots[p->next_cut++ % p->nr_slots];
+			c->buf = buf + pos;
+			c->len = end - pos;
+			c->done = 0;
+			c->error = 0;
+			pos = end;
+
+			pthread_cond_broadcast(&p->cond);
+			continue;
 		}
-		printf("\n");
+		if (ret && p->next_write == p->next_cut) break;
+
+		c = &p->slots[p->next_write % p->nr_slots];
+		while (!c->done) {
+			pthread_cond_wait(&p->cond, &p->lock);
+		}
+		pthread_mutex_unlock(&p->lock);
+
+		if (c->error) ret = c->error;
+		if (!ret) {
+			fwrite(c->out.buf, 1, c->out.len, stderr);
+			print_newlines(c->stats.nr_lines);
+
+			stats->nr_lines += c->stats.nr_lines;
+			stats->nr_tokens += c->stats.nr_tokens;
+			stats->nr_bytes += c->stats.nr_bytes;
+		}
+
+		pthread_mutex_lock(&p->lock);
+		p->next_write++;
 	}
+	pthread_mutex_unlock(&p->lock);
 
-	if (input != stdin) fclose(input);
+	return ret;
+}
+#endif
+
+/***********************************************************************
+ * Buffered output
+ *
+ * stderr is unbuffered, so each fprintf() in process_line() costs a write
+ * system call. With the -b option, the lines are formatted into @output
+ * instead, and written out OUTPUT_FLUSH bytes at a time. The text still goes
+ * to stderr and the empty lines to stdout as without -b. When the input is
+ * a terminal, each line is written out as soon as it is formatted, so that
+ * it shows up before the next one is typed.
+ */
+static int buffered_output = 0;
+static int interactive_output = 0;	/* Flush after every line */
+static struct outbuf output;
+static unsigned long long output_nr_lines;	/* Empty lines owed to stdout */
+
+static void flush_output(void)
+{
+	fwrite(output.buf, 1, output.len, stderr);
+	output.len = 0;
+
+	print_newlines(output_nr_lines);
+	output_nr_lines = 0;
+}
+
+/* Process every line in @buf. Only the last line may lack its '\n' */
+static int process_lines(const char* buf, size_t len, struct parse_stats* stats)
+{
+	const char* end = buf + len;
+
+#ifndef _WIN32
+	if (pool) return pool_process_lines(pool, buf, len, stats);
+#endif
+
+	while (buf < end) {
+		const char* newline = memchr(buf, '\n', end - buf);
+		const char* next = newline ? newline + 1 : end;
+
+		if (buffered_output) {
+			if (format_line(buf, next - buf, &output, stats)) return -ENOMEM;
+			output_nr_lines++;
+			if (output.len >= OUTPUT_FLUSH || interactive_output) flush_output();
+		}
+		else {
+			process_line(buf, next - buf, stats);
+		}
+		buf = next;
+	}
 
 	return 0;
 }
+
+
+/***********************************************************************
+ * process_stream(fd, stats)
+ *
+ * DESCRIPTION
+ *   Read @fd in STREAM_CHUNK sized pieces and process the complete lines in
+ *   each piece. A partial line at the end of a piece is moved to the front of
+ *   the buffer and completed by the next read; the buffer only grows when a
+ *   single line does not fit in it, so lines of any length are kept whole.
+ *
+ * RETURN VALUE
+ *   0 on success, -errno otherwise
+ */
+static int process_stream(int fd, struct parse_stats* stats)
+{
+	size_t size = STREAM_CHUNK;
+	size_t len = 0;
+	char* buf = malloc(size);
+	int ret = 0;
+
+	if (!buf) return -ENOMEM;
+
+	while (1) {
+		size_t complete = 0;
+		long nr_read;
+
+		if (len == size) { /* A line longer than the buffer */
+			char* bigger = realloc(buf, size * 2);
+
+			if (!bigger) {
+				free(buf);
+				return -ENOMEM;
+			}
+			buf = bigger;
+			size *= 2;
+		}
+
+		nr_read = read(fd, buf + len, (unsigned int)(size - len > STREAM_CHUNK ? STREAM_CHUNK : size - len));
+		if (nr_read < 0) {
+			if (errno == EINTR) continue;
+			free(buf);
+			return -errno;
+		}
+		if (nr_read == 0) break;
+
+		/* Lines up to the last '\n' are complete */
+		for (size_t i = len + nr_read; i > len; i--) {
+			if (buf[i - 1] == '\n') {
+				complete = i;
+				break;
+			}
+		}
+		len += nr_read;
+
+		ret = process_lines(buf, complete, stats);
+		if (ret) break;
+
+		memmove(buf, buf + complete, len - complete);
+		len -= complete;
+	}
+	if (!ret) ret = process_lines(buf, len, stats);
+
+	free(buf);
+	return ret;
+}
+
+#ifndef _WIN32
+/***********************************************************************
+ * process_mapped(fd, stats)
+ *
+ * DESCRIPTION
+ *   Map the whole file @fd and process its lines in place, without copying
+ *   them into a line buffer first.
+ *
+ * RETURN VALUE
+ *   0 on success
+ *   -ENODEV if @fd cannot be mapped (e.g., a pipe). Use process_stream() then
+ */
+static int process_mapped(int fd, struct parse_stats* stats)
+{
+	struct stat st;
+	char* map;
+	int ret;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) return -ENODEV;
+	if (st.st_size == 0) return 0;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) return -ENODEV;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	ret = process_lines(map, st.st_size, stats);
+
+	munmap(map, st.st_size);
+	return ret;
+}
+#endif
+
+
+/***********************************************************************
+ * The main function of this program.
+ *
+ *   pa0 [-s] [-b] [-j threads] [input file]
+ *
+ *   -s : report throughput and peak memory usage to stderr at exit
+ *   -b : buffer the output and write it out in large blocks
+ *   -j : tokenize with @threads worker threads. The output is the same
+ *        as the one from a single thread
+ *
+ *   The input file is mapped into memory and tokenized in place. Standard
+ *   input is read in large chunks. In both cases lines of any length are
+ *   tokenized as a whole.
+ */
+int main(int argc, char* const argv[])
+{
+	int fd = fileno(stdin);
+	const char* filename = NULL;
+	int show_stats = 0;
+	int nr_threads = 0;
+	struct parse_stats stats = { 0 };
+	double started;
+	int ret = -ENODEV;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-s") == 0) {
+			show_stats = 1;
+		}
+		else if (strcmp(argv[i], "-b") == 0) {
+			buffered_output = 1;
+		}
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+			nr_threads = atoi(argv[++i]);
+		}
+		else if (argv[i][0] == '-' || filename) {
+			fprintf(stderr, "Usage: %s [-s] [-b] [-j threads] [input file]\n", argv[0]);
+			return -EINVAL;
+		}
+		else {
+			filename = argv[i];
+		}
+	}
+
+	if (filename) {
+		fd = open(filename, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "No input file %s\n", filename);
+			return -EINVAL;
+		}
+	}
+	else if (buffered_output) {
+		/* Asked once, as isatty() is a system call */
+		interactive_output = isatty(fd);
+	}
+
+	if (nr_threads) {
+#ifdef _WIN32
+		fprintf(stderr, "-j is not supported on this platform; using a single thread\n");
+#else
+		pool = pool_create(nr_threads);
+		if (!pool) {
+			fprintf(stderr, "Failed to start %d worker threads\n", nr_threads);
+			return -ENOMEM;
+		}
+#endif
+	}
+
+	started = now_sec();
+
+#ifndef _WIN32
+	ret = process_mapped(fd, &stats);
+#endif
+	if (ret == -ENODEV) ret = process_stream(fd, &stats);
+
+	if (buffered_output) {
+		flush_output();
+		free(output.buf);
+	}
+
+	if (ret) fprintf(stderr, "Failed to read input (%d)\n", ret);
+
+	if (show_stats) print_stats(&stats, now_sec() - started);
+
+#ifndef _WIN32
+	if (pool) pool_destroy(pool);
+#endif
+
+	if (filename) close(fd);
+
+	return ret;
+}
\ No newline at end of file
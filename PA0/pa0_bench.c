@@ -0,0 +1,471 @@
+/**********************************************************************
+ * Copyright (c) 2021-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+/**
+ * Benchmark of the PA0 tokenizers.
+ *
+ * Builds pa0.c and pa0_sol.c into this program (with their main() renamed)
+ * and runs every tokenizer variant over generated corpora. For each variant
+ * it reports ns per input byte, cycles per token, and heap allocations per
+ * line, and checks that all the variants find the same tokens as the scalar
+ * tokenizer in pa0.c.
+ *
+ *   gcc -O2 -pthread -o pa0_bench pa0_bench.c
+ *   ./pa0_bench [MB per corpus]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Count the heap allocations made by the tokenizers */
+static unsigned long long nr_allocs = 0;
+
+static void* bench_malloc(size_t size)
+{
+	nr_allocs++;
+	return malloc(size);
+}
+
+static void* bench_calloc(size_t nmemb, size_t size)
+{
+	nr_allocs++;
+	return calloc(nmemb, size);
+}
+
+static void* bench_realloc(void* ptr, size_t size)
+{
+	nr_allocs++;
+	return realloc(ptr, size);
+}
+
+#define malloc bench_malloc
+#define calloc bench_calloc
+#define realloc bench_realloc
+
+#define main pa0_main
+#include "pa0.c"
+#undef main
+
+#define main pa0_sol_main
+#define parse_command sol_parse_command
+#define parse_command_scalar sol_parse_command_scalar
+#include "pa0_sol.c"
+#undef main
+#undef parse_command
+#undef parse_command_scalar
+
+#undef malloc
+#undef calloc
+#undef realloc
+
+/**
+ * The tokenizer pa0.c had before it switched to token spans. It copies each
+ * token into a static buffer, and then into a freshly malloc()ed string.
+ * Kept here as the baseline to compare against.
+ */
+static int legacy_parse_command(char* command, int* nr_tokens, char* tokens[])
+{
+	int cmdIndex = 0;
+	int tokIndex = 0;
+	int firstPoint = 0;
+	int endPoint = 0;
+	static char resultStr[MAX_TOKEN_LEN] = { '\0' };
+
+	int cmdLen = 0;
+	while (command[cmdLen] != '\0') cmdLen++;
+
+	for (; cmdIndex < cmdLen; cmdIndex++) {
+		if (isspace(command[cmdIndex]) == 0) {
+			firstPoint = cmdIndex;
+
+			for (; cmdIndex < cmdLen; ++cmdIndex) {
+				if (isspace(command[cmdIndex]) != 0) {
+					int strIndex = 0;
+					int strLen = 0;
+					int x = 0;
+
+					endPoint = cmdIndex;
+					for (int i = firstPoint; i < endPoint; i++, strIndex++) {
+						resultStr[strIndex] = command[i];
+					}
+					resultStr[strIndex] = '\0';
+
+					while (resultStr[strLen] != '\0') strLen++;
+
+					tokens[tokIndex] = (char*)bench_malloc(sizeof(char) * (strLen + 1));
+					while (x < strLen + 1) {
+						tokens[tokIndex][x] = resultStr[x];
+						x++;
+					}
+					tokIndex++;
+					break;
+				}
+			}
+		}
+	}
+	*nr_tokens = tokIndex;
+
+	return 0;
+}
+
+
+/***********************************************************************
+ * Tokenizer variants
+ *
+ * Each variant tokenizes @line (NUL-terminated, @len bytes) and reports the
+ * tokens as spans into @line. The in-place tokenizers modify @line, so the
+ * benchmark always hands them a fresh copy.
+ */
+typedef int (*variant_fn)(char* line, size_t len, struct token_span tokens[]);
+
+static int spans_from_pointers(char* line, int nr, char* pointers[], struct token_span tokens[])
+{
+	for (int i = 0; i < nr; i++) {
+		tokens[i].offset = (unsigned int)(pointers[i] - line);
+		tokens[i].len = (unsigned int)strlen(pointers[i]);
+	}
+	return nr;
+}
+
+static int run_legacy(char* line, size_t len, struct token_span tokens[])
+{
+	char* copies[MAX_NR_TOKENS];
+	int nr;
+
+	legacy_parse_command(line, &nr, copies);
+
+	/* The copies do not point into @line; match them up by position */
+	for (int i = 0, pos = 0; i < nr; i++) {
+		while (is_whitespace(line[pos])) pos++;
+		tokens[i].offset = pos;
+		tokens[i].len = (unsigned int)strlen(copies[i]);
+		pos += tokens[i].len;
+		free(copies[i]);
+	}
+	(void)len;
+	return nr;
+}
+
+static int run_pa0_scalar(char* line, size_t len, struct token_span tokens[])
+{
+	int nr;
+
+	parse_command_scalar(line, len, &nr, tokens);
+	return nr;
+}
+
+static int run_pa0(char* line, size_t len, struct token_span tokens[])
+{
+	int nr;
+
+	parse_command(line, len, &nr, tokens);
+	return nr;
+}
+
+static int run_sol_scalar(char* line, size_t len, struct token_span tokens[])
+{
+	char* pointers[MAX_NR_TOKENS];
+	int nr;
+
+	sol_parse_command_scalar(line, &nr, pointers);
+	(void)len;
+	return spans_from_pointers(line, nr, pointers, tokens);
+}
+
+static int run_sol(char* line, size_t len, struct token_span tokens[])
+{
+	char* pointers[MAX_NR_TOKENS];
+	int nr;
+
+	sol_parse_command(line, &nr, pointers);
+	(void)len;
+	return spans_from_pointers(line, nr, pointers, tokens);
+}
+
+static int run_spans_scalar(char* line, size_t len, struct token_span tokens[])
+{
+	return tokenize_spans_with(line, len, tokens, MAX_NR_TOKENS, ws_mask64_scalar);
+}
+
+#ifdef TOKENIZER_SSE2
+static int run_spans_sse2(char* line, size_t len, struct token_span tokens[])
+{
+	return tokenize_spans_with(line, len, tokens, MAX_NR_TOKENS, ws_mask64_sse2);
+}
+#endif
+
+#ifdef TOKENIZER_AVX2
+static int run_spans_avx2(char* line, size_t len, struct token_span tokens[])
+{
+	return tokenize_spans_with(line, len, tokens, MAX_NR_TOKENS, ws_mask64_avx2);
+}
+#endif
+
+static const struct variant {
+	const char* name;
+	variant_fn fn;
+	int needs;	/* 0: always, 1: sse2, 2: avx2 */
+} variants[] = {
+	{ "pa0.c legacy copy",	run_legacy,		0 },
+	{ "pa0.c scalar",		run_pa0_scalar,	0 },
+	{ "pa0.c",				run_pa0,		0 },
+	{ "pa0_sol.c scalar",	run_sol_scalar,	0 },
+	{ "pa0_sol.c",			run_sol,		0 },
+	{ "spans mask scalar",	run_spans_scalar,	0 },
+#ifdef TOKENIZER_SSE2
+	{ "spans mask sse2",	run_spans_sse2,	1 },
+#endif
+#ifdef TOKENIZER_AVX2
+	{ "spans mask avx2",	run_spans_avx2,	2 },
+#endif
+};
+
+
+/***********************************************************************
+ * Corpora
+ *
+ * A corpus is a sequence of NUL-terminated lines, each ending with '\n'.
+ * Tokens are kept shorter than MAX_TOKEN_LEN and lines have at most
+ * MAX_NR_TOKENS tokens so that the legacy tokenizer can handle them.
+ */
+struct corpus {
+	const char* name;
+	char* text;
+	size_t size;
+	unsigned int* lines;	/* Offset of each line in @text */
+	size_t nr_lines;
+	size_t nr_bytes;		/* Excluding the NULs */
+};
+
+static unsigned int seed = 212;
+
+static unsigned int rnd(unsigned int n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+static void append_ws(char* line, size_t* len, int tabs, int max)
+{
+	int n = 1 + rnd(max);
+
+	for (int i = 0; i < n; i++) {
+		line[(*len)++] = (tabs && rnd(4)) ? '\t' : ' ';
+	}
+}
+
+/* Generate a line into @line; returns its length */
+static size_t generate_line(const char* kind, char* line)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789$_,.!";
+	size_t len = 0;
+	int nr_tokens, token_len, max_ws, tabs = 0;
+
+	if (strcmp(kind, "short") == 0) {
+		nr_tokens = 1 + rnd(4);
+		token_len = 4;
+		max_ws = 2;
+	}
+	else if (strcmp(kind, "long") == 0) {
+		nr_tokens = 8 + rnd(8);
+		token_len = 63;
+		max_ws = 24;
+	}
+	else if (strcmp(kind, "tabs") == 0) {
+		nr_tokens = 2 + rnd(8);
+		token_len = 8;
+		max_ws = 6;
+		tabs = 1;
+	}
+	else { /* "many" */
+		nr_tokens = MAX_NR_TOKENS;
+		token_len = 3;
+		max_ws = 1;
+	}
+
+	if (rnd(2)) append_ws(line, &len, tabs, max_ws);
+	for (int i = 0; i < nr_tokens; i++) {
+		int n = 1 + rnd(token_len);
+
+		if (i) append_ws(line, &len, tabs, max_ws);
+		for (int j = 0; j < n; j++) {
+			line[len++] = chars[rnd(sizeof(chars) - 1)];
+		}
+	}
+	if (rnd(2)) append_ws(line, &len, tabs, max_ws);
+	line[len++] = '\n';
+	line[len] = '\0';
+
+	return len;
+}
+
+static int generate_corpus(struct corpus* c, const char* kind, size_t bytes)
+{
+	size_t max_lines = bytes / 8 + 1;
+
+	c->name = kind;
+	c->size = bytes + 4096;
+	c->text = malloc(c->size);
+	c->lines = malloc(max_lines * sizeof(*c->lines));
+	c->nr_lines = 0;
+	c->nr_bytes = 0;
+	if (!c->text || !c->lines) return -ENOMEM;
+
+	for (size_t pos = 0; pos < bytes && c->nr_lines < max_lines; ) {
+		size_t len = generate_line(kind, c->text + pos);
+
+		c->lines[c->nr_lines++] = (unsigned int)pos;
+		c->nr_bytes += len;
+		pos += len + 1;
+	}
+	return 0;
+}
+
+
+/***********************************************************************
+ * Measurement
+ */
+static inline unsigned long long cycles(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* FNV-1a over the tokens found in the corpus */
+static unsigned long long hash_tokens(unsigned long long hash, const char* line,
+	int nr, const struct token_span tokens[])
+{
+	hash = (hash ^ nr) * 0x100000001b3ULL;
+	for (int i = 0; i < nr; i++) {
+		for (unsigned int j = 0; j < tokens[i].len; j++) {
+			hash = (hash ^ (unsigned char)line[tokens[i].offset + j]) * 0x100000001b3ULL;
+		}
+		hash = (hash ^ 0xff) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/**
+ * Run @v over @c, comparing each line against the pa0.c scalar tokenizer.
+ * Returns the number of mismatching lines.
+ */
+static size_t verify(const struct variant* v, const struct corpus* c, char* scratch)
+{
+	size_t mismatches = 0;
+
+	for (size_t i = 0; i < c->nr_lines; i++) {
+		const char* line = c->text + c->lines[i];
+		size_t len = strlen(line);
+		struct token_span expected[MAX_NR_TOKENS], tokens[MAX_NR_TOKENS];
+		int nr_expected, nr;
+
+		parse_command_scalar(line, len, &nr_expected, expected);
+
+		memcpy(scratch, line, len + 1);
+		nr = v->fn(scratch, len, tokens);
+
+		if (nr != nr_expected) {
+			mismatches++;
+			continue;
+		}
+		for (int j = 0; j < nr; j++) {
+			if (tokens[j].len != expected[j].len ||
+				memcmp(line + tokens[j].offset, line + expected[j].offset, tokens[j].len)) {
+				mismatches++;
+				break;
+			}
+		}
+	}
+	return mismatches;
+}
+
+/* Benchmark @v on @c; returns the number of lines it tokenized differently */
+static size_t bench(const struct variant* v, const struct corpus* c, char* scratch, int rounds)
+{
+	unsigned long long nr_tokens = 0, hash = 0xcbf29ce484222325ULL;
+	unsigned long long allocs;
+	unsigned long long started_cycles;
+	double started, elapsed;
+	size_t mismatches = verify(v, c, scratch);
+
+	allocs = nr_allocs;	/* Only those of the timed rounds */
+	started = now_sec();
+	started_cycles = cycles();
+	for (int r = 0; r < rounds; r++) {
+		for (size_t i = 0; i < c->nr_lines; i++) {
+			const char* line = c->text + c->lines[i];
+			size_t len = strlen(line);
+			struct token_span tokens[MAX_NR_TOKENS];
+			int nr;
+
+			memcpy(scratch, line, len + 1);
+			nr = v->fn(scratch, len, tokens);
+			nr_tokens += nr;
+			hash = hash_tokens(hash, line, nr, tokens);
+		}
+	}
+	elapsed = now_sec() - started;
+
+	printf("  %-20s %8.3f ns/byte %8.2f cycles/token %8.2f allocs/line   %s %016llx\n",
+		v->name,
+		elapsed * 1e9 / ((double)c->nr_bytes * rounds),
+		nr_tokens ? (double)(cycles() - started_cycles) / nr_tokens : 0.0,
+		(double)(nr_allocs - allocs) / ((double)c->nr_lines * rounds),
+		mismatches ? "MISMATCH" : "ok", hash);
+
+	return mismatches;
+}
+
+int main(int argc, char* argv[])
+{
+	static const char* kinds[] = { "short", "long", "tabs", "many" };
+	size_t bytes = (size_t)(argc > 1 ? atoi(argv[1]) : 4) << 20;
+	char scratch[8192];
+	int failed = 0;
+
+	if (bytes == 0) {
+		fprintf(stderr, "Usage: %s [MB per corpus]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	tokenizer_select();
+	printf("SIMD whitespace classifier: %s\n", __ws_mask64_name);
+
+	for (size_t k = 0; k < sizeof(kinds) / sizeof(*kinds); k++) {
+		struct corpus c;
+
+		if (generate_corpus(&c, kinds[k], bytes)) {
+			fprintf(stderr, "Out of memory\n");
+			return EXIT_FAILURE;
+		}
+		printf("\n%s lines: %zu lines, %zu bytes\n", c.name, c.nr_lines, c.nr_bytes);
+
+		for (size_t i = 0; i < sizeof(variants) / sizeof(*variants); i++) {
+			const struct variant* v = &variants[i];
+
+			if (v->needs == 2 && strcmp(__ws_mask64_name, "avx2")) continue;
+			if (v->needs == 1 && strcmp(__ws_mask64_name, "scalar") == 0) continue;
+
+			failed |= bench(v, &c, scratch, 3) != 0;
+		}
+		free(c.text);
+		free(c.lines);
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
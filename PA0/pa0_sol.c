@@ -15,9 +15,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <ctype.h> //isspace() 
 
+#include "tokenizer.h"
+
  /* To avoid security error on Visual Studio */
 #define _CRT_SECURE_NO_WARNINGS
 #pragma warning(disable : 4996)
@@ -67,7 +70,7 @@
 #define false 0
 typedef char bool;
 
-static int parse_command(char* command, int* nr_tokens, char* tokens[])
+static int parse_command_scalar(char* command, int* nr_tokens, char* tokens[])
 {
 	/* TODO
 	 * Followings are example code. You should delete them and implement
@@ -98,6 +101,29 @@ static int parse_command(char* command, int* nr_tokens, char* tokens[])
 	return 0;
 }
 
+/**
+ * Same as parse_command_scalar(), but finds the token boundaries with SIMD
+ * whitespace masks. Only the end of each token is overwritten with '\0'.
+ */
+static int parse_command(char* command, int* nr_tokens, char* tokens[])
+{
+	struct token_span spans[MAX_NR_TOKENS];
+	int nr;
+
+	if (!tokenizer_has_simd())
+		return parse_command_scalar(command, nr_tokens, tokens);
+
+	nr = tokenize_spans(command, strlen(command), spans, MAX_NR_TOKENS);
+	for (int i = 0; i < nr; i++) {
+		tokens[i] = command + spans[i].offset;
+		tokens[i][spans[i].len] = '\0';
+	}
+
+	*nr_tokens = nr;
+
+	return 0;
+}
+
 
 /***********************************************************************
  * The main function of this program. DO NOT CHANGE THE CODE BELOW
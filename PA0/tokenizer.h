@@ -0,0 +1,249 @@
+/**********************************************************************
+ * Copyright (c) 2021-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+/**
+ * Vectorized command tokenizer shared by pa0.c and pa0_sol.c.
+ *
+ * Instead of calling isspace() for every byte, the command is classified 64
+ * bytes at a time into a bitmask of whitespace positions (SSE2, or AVX2 when
+ * the CPU supports it). Token boundaries are the bits where the mask flips,
+ * and they are walked with count-trailing-zeros. Tails shorter than a block
+ * are classified by the scalar loop.
+ */
+#ifndef __TOKENIZER_H__
+#define __TOKENIZER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TOKENIZER_SSE2
+#define TOKENIZER_AVX2
+#define TOKENIZER_TARGET(isa) __attribute__((target(isa)))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+#include <intrin.h>
+#include <emmintrin.h>
+#define TOKENIZER_SSE2
+#define TOKENIZER_TARGET(isa)
+#endif
+
+/**
+ * A command token is not copied out of the command string. Instead, it is
+ * described by the index of its first character (@offset) and its length
+ * (@len) in the command buffer, so tokenizing a command never allocates.
+ */
+struct token_span {
+	unsigned int offset;
+	unsigned int len;
+};
+
+/* Returns a bitmask of the whitespace bytes in the 64 bytes at @p */
+typedef uint64_t (*ws_mask64_fn)(const unsigned char* p);
+
+/**
+ * Whitespace as isspace() sees it in the "C" locale, that is,
+ * ' ', '\t', '\n', '\v', '\f', and '\r'
+ */
+static inline int is_whitespace(unsigned char c)
+{
+	return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+static inline unsigned int ctz64(uint64_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(x);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+	unsigned long index;
+	_BitScanForward64(&index, x);
+	return index;
+#else
+	unsigned int index = 0;
+	while (!(x & 1)) {
+		x >>= 1;
+		index++;
+	}
+	return index;
+#endif
+}
+
+/* Classify @len (<= 64) bytes one at a time */
+static inline uint64_t ws_mask_scalar(const unsigned char* p, size_t len)
+{
+	uint64_t mask = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (is_whitespace(p[i])) mask |= 1ULL << i;
+	}
+	return mask;
+}
+
+static uint64_t ws_mask64_scalar(const unsigned char* p)
+{
+	return ws_mask_scalar(p, 64);
+}
+
+#ifdef TOKENIZER_SSE2
+TOKENIZER_TARGET("sse2")
+static uint64_t ws_mask64_sse2(const unsigned char* p)
+{
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i range = _mm_set1_epi8('\r' - '\t');
+	uint64_t mask = 0;
+
+	for (int i = 0; i < 64; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+		__m128i d = _mm_sub_epi8(v, tab);
+		/* d <= range as unsigned bytes iff min(d, range) == d */
+		__m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+			_mm_cmpeq_epi8(_mm_min_epu8(d, range), d));
+
+		mask |= (uint64_t)(unsigned int)_mm_movemask_epi8(ws) << i;
+	}
+	return mask;
+}
+#endif
+
+#ifdef TOKENIZER_AVX2
+TOKENIZER_TARGET("avx2")
+static uint64_t ws_mask64_avx2(const unsigned char* p)
+{
+	const __m256i space = _mm256_set1_epi8(' ');
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i range = _mm256_set1_epi8('\r' - '\t');
+	uint64_t mask = 0;
+
+	for (int i = 0; i < 64; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+		__m256i d = _mm256_sub_epi8(v, tab);
+		__m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+			_mm256_cmpeq_epi8(_mm256_min_epu8(d, range), d));
+
+		mask |= (uint64_t)(unsigned int)_mm256_movemask_epi8(ws) << i;
+	}
+	return mask;
+}
+#endif
+
+static ws_mask64_fn __ws_mask64;
+static const char* __ws_mask64_name;
+
+/**
+ * Pick the widest whitespace classifier the running CPU supports, and keep
+ * it in @__ws_mask64 for tokenize_spans(). Only the first call writes it,
+ * without any locking, so a program that tokenizes on several threads has
+ * to call this before starting them; pa0.c does in pool_create().
+ */
+static ws_mask64_fn tokenizer_select(void)
+{
+	ws_mask64_fn fn = ws_mask64_scalar;
+	const char* name = "scalar";
+
+	if (__ws_mask64) return __ws_mask64;
+
+#if defined(TOKENIZER_AVX2)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		fn = ws_mask64_avx2;
+		name = "avx2";
+	}
+	else if (__builtin_cpu_supports("sse2")) {
+		fn = ws_mask64_sse2;
+		name = "sse2";
+	}
+#elif defined(TOKENIZER_SSE2)
+	fn = ws_mask64_sse2;
+	name = "sse2";
+#endif
+	__ws_mask64_name = name;
+	__ws_mask64 = fn;
+
+	return fn;
+}
+
+static inline int tokenizer_has_simd(void)
+{
+	return tokenizer_select() != ws_mask64_scalar;
+}
+
+/***********************************************************************
+ * tokenize_spans_with(command, len, tokens, max, mask64)
+ *
+ * DESCRIPTION
+ *   Split the first @len bytes of @command into whitespace-separated tokens
+ *   using @mask64 to classify each full 64-byte block. Stops after @max
+ *   tokens. @command does not need to be NUL-terminated.
+ *
+ *   Bit i of the shifted mask tells whether the byte before byte i is
+ *   whitespace, so (mask ^ shifted) has a bit set exactly at the first byte
+ *   of each token and at the first whitespace after it.
+ *
+ * RETURN VALUE
+ *   The number of tokens put into @tokens[]
+ */
+static int tokenize_spans_with(const char* command, size_t len,
+	struct token_span tokens[], int max, ws_mask64_fn mask64)
+{
+	const unsigned char* p = (const unsigned char*)command;
+	uint64_t prev_ws = 1;	/* Text before @command counts as whitespace */
+	size_t start = 0;
+	int nr = 0;
+
+	if (max <= 0) return 0;
+
+	for (size_t base = 0; base < len; base += 64) {
+		size_t n = len - base < 64 ? len - base : 64;
+		uint64_t ws, edges;
+
+		if (n == 64) {
+			ws = mask64(p + base);
+		}
+		else { /* Tail; pretend the bytes past @len are whitespace */
+			ws = ws_mask_scalar(p + base, n) | (~0ULL << n);
+		}
+		edges = ws ^ ((ws << 1) | prev_ws);
+		prev_ws = ws >> 63;
+
+		while (edges) {
+			unsigned int i = ctz64(edges);
+
+			if (!((ws >> i) & 1)) {
+				start = base + i;
+			}
+			else {
+				tokens[nr].offset = (unsigned int)start;
+				tokens[nr].len = (unsigned int)(base + i - start);
+				if (++nr == max) return nr;
+			}
+			edges &= edges - 1;
+		}
+	}
+
+	if (!prev_ws) { /* A token runs up to the end of a 64-byte aligned @len */
+		tokens[nr].offset = (unsigned int)start;
+		tokens[nr].len = (unsigned int)(len - start);
+		nr++;
+	}
+	return nr;
+}
+
+static inline int tokenize_spans(const char* command, size_t len, struct token_span tokens[], int max)
+{
+	return tokenize_spans_with(command, len, tokens, max, tokenizer_select());
+}
+
+#endif
@@ -0,0 +1,285 @@
+/**********************************************************************
+ * Copyright (c) 2021-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+/**
+ * Packing of MIPS instruction fields into instruction words, shared by the
+ * assembler in pa1.c and by programs that generate instructions directly.
+ *
+ * R_FORMAT(), I_FORMAT(), and J_FORMAT() pack a single instruction.
+ * encode_fields() packs many instructions whose fields are given as one
+ * array per field, with SSE2 (or AVX2 when the CPU supports it) shifting
+ * and or-ing the fields of several instructions at once. It can also store
+ * the words big-endian, as they are laid out in a program image and in the
+ * memory of PA2, so a generator can fill in an image (see image.h) without
+ * going through assembly text at all.
+ */
+#ifndef __ENCODER_H__
+#define __ENCODER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "image.h"	/* bswap32() */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ENCODER_SSE2
+#define ENCODER_AVX2
+#define ENCODER_TARGET(isa) __attribute__((target(isa)))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+#include <emmintrin.h>
+#define ENCODER_SSE2
+#define ENCODER_TARGET(isa)
+#endif
+
+/**
+ * Pack the fields of an instruction into a 32-bit word
+ *
+ * R-format : opcode(6 bits) + rs(5 bits) + rt(5 bits) + rd(5 bits) + shamt(5 bits) + funct(6 bits)
+ * I-format : opcode(6 bits) + rs(5 bits) + rt(5 bits) + constant or address(16 bits)
+ * J-format : opcode(6 bits) + address(26 bits)
+ */
+#define R_FORMAT(opcode, rs, rt, rd, shamt, funct) \
+	((((opcode) & 0x3fu) << 26) | (((rs) & 0x1fu) << 21) | (((rt) & 0x1fu) << 16) | \
+	 (((rd) & 0x1fu) << 11) | (((shamt) & 0x1fu) << 6) | ((funct) & 0x3fu))
+#define I_FORMAT(opcode, rs, rt, immediate) \
+	((((opcode) & 0x3fu) << 26) | (((rs) & 0x1fu) << 21) | (((rt) & 0x1fu) << 16) | \
+	 ((immediate) & 0xffffu))
+#define J_FORMAT(opcode, address) \
+	((((opcode) & 0x3fu) << 26) | (((address) >> 2) & 0x3ffffffu))
+
+/**
+ * Fields of a run of instructions, one array per field. Which fields an
+ * instruction uses follows from its opcode: opcode 0 is R-format and uses
+ * @rd, @shamt, and @funct; opcodes 2 (j) and 3 (jal) are J-format and take
+ * the target address from @immediate; everything else is I-format and
+ * takes the low 16 bits of @immediate. Unused fields are ignored, but they
+ * still have to be readable.
+ */
+struct instruction_fields {
+	const uint8_t* opcode;
+	const uint8_t* rs;
+	const uint8_t* rt;
+	const uint8_t* rd;
+	const uint8_t* shamt;
+	const uint8_t* funct;
+	const uint32_t* immediate;
+};
+
+typedef void (*encode_fields_fn)(const struct instruction_fields* fields,
+	size_t from, size_t to, uint32_t* words, int big_endian);
+
+/* Words are stored in host order, or so that their bytes are big-endian */
+static inline uint32_t to_byte_order(uint32_t word, int big_endian)
+{
+	const uint16_t probe = 1;
+
+	if (!big_endian || *(const uint8_t*)&probe == 0) return word;
+	return bswap32(word);
+}
+
+static inline uint32_t encode_one(const struct instruction_fields* f, size_t i)
+{
+	unsigned int opcode = f->opcode[i];
+
+	if (opcode == 0) {
+		return R_FORMAT(0, f->rs[i], f->rt[i], f->rd[i], f->shamt[i], f->funct[i]);
+	}
+	if (opcode == 2 || opcode == 3) {
+		return J_FORMAT(opcode, f->immediate[i]);
+	}
+	return I_FORMAT(opcode, f->rs[i], f->rt[i], f->immediate[i]);
+}
+
+static void encode_fields_scalar(const struct instruction_fields* fields,
+	size_t from, size_t to, uint32_t* words, int big_endian)
+{
+	for (size_t i = from; i < to; i++) {
+		words[i] = to_byte_order(encode_one(fields, i), big_endian);
+	}
+}
+
+#ifdef ENCODER_SSE2
+/* Pack four instructions whose fields are in the 32-bit lanes */
+ENCODER_TARGET("sse2")
+static inline __m128i encode4_sse2(__m128i opcode, __m128i rs, __m128i rt,
+	__m128i rd, __m128i shamt, __m128i funct, __m128i immediate)
+{
+	const __m128i m5 = _mm_set1_epi32(0x1f), m6 = _mm_set1_epi32(0x3f);
+	const __m128i is_r = _mm_cmpeq_epi32(opcode, _mm_setzero_si128());
+	const __m128i is_j = _mm_cmpeq_epi32(_mm_or_si128(opcode, _mm_set1_epi32(1)), _mm_set1_epi32(3));
+	__m128i upper, r_low, i_low, j_low, word;
+
+	upper = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(opcode, m6), 26),
+		_mm_or_si128(_mm_slli_epi32(_mm_and_si128(rs, m5), 21), _mm_slli_epi32(_mm_and_si128(rt, m5), 16)));
+	r_low = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(rd, m5), 11),
+		_mm_or_si128(_mm_slli_epi32(_mm_and_si128(shamt, m5), 6), _mm_and_si128(funct, m6)));
+	i_low = _mm_and_si128(immediate, _mm_set1_epi32(0xffff));
+	j_low = _mm_and_si128(_mm_srli_epi32(immediate, 2), _mm_set1_epi32(0x3ffffff));
+
+	word = _mm_or_si128(upper, _mm_or_si128(_mm_and_si128(is_r, r_low), _mm_andnot_si128(is_r, i_low)));
+	/* J-format keeps only the opcode of @upper */
+	return _mm_or_si128(_mm_andnot_si128(is_j, word),
+		_mm_and_si128(is_j, _mm_or_si128(_mm_slli_epi32(opcode, 26), j_low)));
+}
+
+ENCODER_TARGET("sse2")
+static inline __m128i bswap32_sse2(__m128i x)
+{
+	const __m128i mid = _mm_set1_epi32(0xff00);
+
+	return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(x, 24), _mm_srli_epi32(x, 24)),
+		_mm_or_si128(_mm_and_si128(_mm_srli_epi32(x, 8), mid), _mm_slli_epi32(_mm_and_si128(x, mid), 8)));
+}
+
+/* Widen 16 bytes into four vectors of 32-bit lanes */
+ENCODER_TARGET("sse2")
+static inline void widen16_sse2(const uint8_t* p, __m128i out[4])
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v = _mm_loadu_si128((const __m128i*)p);
+	__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+
+	out[0] = _mm_unpacklo_epi16(lo, zero);
+	out[1] = _mm_unpackhi_epi16(lo, zero);
+	out[2] = _mm_unpacklo_epi16(hi, zero);
+	out[3] = _mm_unpackhi_epi16(hi, zero);
+}
+
+ENCODER_TARGET("sse2")
+static void encode_fields_sse2(const struct instruction_fields* f,
+	size_t from, size_t to, uint32_t* words, int big_endian)
+{
+	const int swap = to_byte_order(1, big_endian) != 1;
+	size_t i = from;
+
+	for (; i + 16 <= to; i += 16) {
+		__m128i opcode[4], rs[4], rt[4], rd[4], shamt[4], funct[4];
+
+		widen16_sse2(f->opcode + i, opcode);
+		widen16_sse2(f->rs + i, rs);
+		widen16_sse2(f->rt + i, rt);
+		widen16_sse2(f->rd + i, rd);
+		widen16_sse2(f->shamt + i, shamt);
+		widen16_sse2(f->funct + i, funct);
+
+		for (int j = 0; j < 4; j++) {
+			__m128i immediate = _mm_loadu_si128((const __m128i*)(f->immediate + i + 4 * j));
+			__m128i word = encode4_sse2(opcode[j], rs[j], rt[j], rd[j], shamt[j], funct[j], immediate);
+
+			if (swap) word = bswap32_sse2(word);
+			_mm_storeu_si128((__m128i*)(words + i + 4 * j), word);
+		}
+	}
+	encode_fields_scalar(f, i, to, words, big_endian);
+}
+#endif
+
+#ifdef ENCODER_AVX2
+ENCODER_TARGET("avx2")
+static inline __m256i widen8_avx2(const uint8_t* p)
+{
+	return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p));
+}
+
+ENCODER_TARGET("avx2")
+static void encode_fields_avx2(const struct instruction_fields* f,
+	size_t from, size_t to, uint32_t* words, int big_endian)
+{
+	const __m256i m5 = _mm256_set1_epi32(0x1f), m6 = _mm256_set1_epi32(0x3f);
+	const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	const int swap = to_byte_order(1, big_endian) != 1;
+	size_t i = from;
+
+	for (; i + 8 <= to; i += 8) {
+		__m256i opcode = widen8_avx2(f->opcode + i);
+		__m256i immediate = _mm256_loadu_si256((const __m256i*)(f->immediate + i));
+		__m256i is_r = _mm256_cmpeq_epi32(opcode, _mm256_setzero_si256());
+		__m256i is_j = _mm256_cmpeq_epi32(_mm256_or_si256(opcode, _mm256_set1_epi32(1)), _mm256_set1_epi32(3));
+		__m256i upper, r_low, i_low, j_word, word;
+
+		upper = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(opcode, m6), 26),
+			_mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(widen8_avx2(f->rs + i), m5), 21),
+				_mm256_slli_epi32(_mm256_and_si256(widen8_avx2(f->rt + i), m5), 16)));
+		r_low = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(widen8_avx2(f->rd + i), m5), 11),
+			_mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(widen8_avx2(f->shamt + i), m5), 6),
+				_mm256_and_si256(widen8_avx2(f->funct + i), m6)));
+		i_low = _mm256_and_si256(immediate, _mm256_set1_epi32(0xffff));
+		j_word = _mm256_or_si256(_mm256_slli_epi32(opcode, 26),
+			_mm256_and_si256(_mm256_srli_epi32(immediate, 2), _mm256_set1_epi32(0x3ffffff)));
+
+		word = _mm256_or_si256(upper, _mm256_blendv_epi8(i_low, r_low, is_r));
+		word = _mm256_blendv_epi8(word, j_word, is_j);
+
+		if (swap) word = _mm256_shuffle_epi8(word, bswap);
+		_mm256_storeu_si256((__m256i*)(words + i), word);
+	}
+	encode_fields_scalar(f, i, to, words, big_endian);
+}
+#endif
+
+static encode_fields_fn __encode_fields;
+static const char* __encode_fields_name;
+
+/**
+ * Pick the widest encoder the running CPU supports. The choice is stored in
+ * @__encode_fields by the first call, unsynchronized, and only read by the
+ * calls after it. A program that calls encode_fields() from several
+ * threads has to call this once before starting them.
+ */
+static encode_fields_fn encoder_select(void)
+{
+	encode_fields_fn fn = encode_fields_scalar;
+	const char* name = "scalar";
+
+	if (__encode_fields) return __encode_fields;
+
+#if defined(ENCODER_AVX2)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		fn = encode_fields_avx2;
+		name = "avx2";
+	}
+	else if (__builtin_cpu_supports("sse2")) {
+		fn = encode_fields_sse2;
+		name = "sse2";
+	}
+#elif defined(ENCODER_SSE2)
+	fn = encode_fields_sse2;
+	name = "sse2";
+#endif
+	__encode_fields_name = name;
+	__encode_fields = fn;
+
+	return fn;
+}
+
+/***********************************************************************
+ * encode_fields(fields, nr, words, big_endian)
+ *
+ * DESCRIPTION
+ *   Pack the first @nr instructions in @fields into @words[]. The words are
+ *   stored in host byte order, or with their bytes in big-endian order if
+ *   @big_endian is set, which is the layout of a program image.
+ */
+static inline void encode_fields(const struct instruction_fields* fields, size_t nr,
+	uint32_t* words, int big_endian)
+{
+	encoder_select()(fields, 0, nr, words, big_endian);
+}
+
+#endif
@@ -0,0 +1,161 @@
+/**********************************************************************
+ * Copyright (c) 2021-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+/**
+ * Binary program image, written by the PA1 assembler (pa1 -o) and loaded by
+ * the PA2 emulator.
+ *
+ * An image is a header followed by @length bytes of big-endian instruction
+ * words, which are copied as they are to @load_addr of the machine memory.
+ * Every header field is a big-endian 32-bit word as well:
+ *
+ *   offset  0 : magic "MIPS"
+ *   offset  4 : entry PC
+ *   offset  8 : load address
+ *   offset 12 : length of the payload in bytes
+ *   offset 16 : Adler-32 checksum of the payload
+ *
+ * The text program format of PA2 starts with "0x", so the two never mix up.
+ *
+ * get_be32() and put_be32() are also how PA2 accesses the words of its
+ * memory, which keeps them big-endian as well. Where the compiler tells the
+ * byte order of the host, they access a word with a single load or store,
+ * and swap its bytes on little-endian hosts.
+ */
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _MSC_VER
+#include <stdlib.h>	/* _byteswap_ulong() */
+#endif
+
+#define IMAGE_MAGIC			"MIPS"
+#define IMAGE_HEADER_SIZE	20
+
+struct image_header {
+	unsigned int entry;
+	unsigned int load_addr;
+	unsigned int length;
+	unsigned int checksum;
+};
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_LITTLE_ENDIAN
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_BIG_ENDIAN
+#elif defined(_MSC_VER)		/* Windows runs little-endian only */
+#define HOST_LITTLE_ENDIAN
+#endif
+
+static inline uint32_t bswap32(uint32_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_bswap32(x);
+#elif defined(_MSC_VER)
+	return _byteswap_ulong(x);
+#else
+	return (x << 24) | ((x << 8) & 0xff0000u) | ((x >> 8) & 0xff00u) | (x >> 24);
+#endif
+}
+
+/* The big-endian word at @p, which need not be aligned */
+static inline unsigned int get_be32(const unsigned char* p)
+{
+#if defined(HOST_LITTLE_ENDIAN) || defined(HOST_BIG_ENDIAN)
+	uint32_t word;
+
+	memcpy(&word, p, 4);
+#ifdef HOST_LITTLE_ENDIAN
+	word = bswap32(word);
+#endif
+	return word;
+#else
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+#endif
+}
+
+static inline void put_be32(unsigned char* p, unsigned int value)
+{
+#if defined(HOST_LITTLE_ENDIAN) || defined(HOST_BIG_ENDIAN)
+	uint32_t word = value;
+
+#ifdef HOST_LITTLE_ENDIAN
+	word = bswap32(word);
+#endif
+	memcpy(p, &word, 4);
+#else
+	p[0] = value >> 24;
+	p[1] = (value >> 16) & 0xff;
+	p[2] = (value >> 8) & 0xff;
+	p[3] = value & 0xff;
+#endif
+}
+
+/* Adler-32, deferring the modulo for as long as the sums cannot overflow */
+static unsigned int image_checksum(const unsigned char* data, size_t len)
+{
+	unsigned int a = 1, b = 0;
+
+	while (len) {
+		size_t n = len < 5552 ? len : 5552;
+
+		len -= n;
+		while (n--) {
+			a += *data++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+static inline void image_write_header(unsigned char* p, const struct image_header* header)
+{
+	memcpy(p, IMAGE_MAGIC, 4);
+	put_be32(p + 4, header->entry);
+	put_be32(p + 8, header->load_addr);
+	put_be32(p + 12, header->length);
+	put_be32(p + 16, header->checksum);
+}
+
+/**
+ * Parse the image header at the beginning of the @len bytes at @p.
+ *
+ * RETURN VALUE
+ *   0 if @p starts with an image header
+ *   -ENOEXEC if it does not
+ *   -EINVAL if the header is cut short or claims more payload than follows
+ */
+static inline int image_read_header(const unsigned char* p, size_t len, struct image_header* header)
+{
+	if (len < 4 || memcmp(p, IMAGE_MAGIC, 4)) return -ENOEXEC;
+	if (len < IMAGE_HEADER_SIZE) return -EINVAL;
+
+	header->entry = get_be32(p + 4);
+	header->load_addr = get_be32(p + 8);
+	header->length = get_be32(p + 12);
+	header->checksum = get_be32(p + 16);
+
+	if (header->length > len - IMAGE_HEADER_SIZE) return -EINVAL;
+
+	return 0;
+}
+
+#endif
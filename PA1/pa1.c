@@ -18,6 +18,15 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+#include "image.h"
+#include "encoder.h"
 
  /* To avoid security error on Visual Studio */
 #define _CRT_SECURE_NO_WARNINGS
@@ -29,19 +38,386 @@
 #define MAX_TOKEN_LEN	64	/* Maximum length of single token */
 #define MAX_ASSEMBLY	256 /* Maximum length of assembly string */
 
+#ifndef true	/* PA2 includes this file after defining its own */
 typedef unsigned char bool;
 #define true	1
 #define false	0
+#endif
 /*          ****** DO NOT MODIFY ANYTHING UP TO THIS LINE ******      */
 /*====================================================================*/
 
 
+#define INITIAL_PC	0x1000	/* Where PA2 loads and starts programs */
+
+/**
+ * How the operands of an instruction are written in assembly, from
+ * tokens[1] to tokens[3]
+ */
+enum operand_layout {
+	OPERANDS_RD_RS_RT,		/* add rd rs rt */
+	OPERANDS_RD_RT_SHAMT,	/* sll rd rt shamt */
+	OPERANDS_RT_RS_IMM,		/* addi rt rs immediate */
+	OPERANDS_RT_RS_OFFSET,	/* beq rt rs offset-or-label */
+	OPERANDS_TARGET,		/* j address-or-label */
+	OPERANDS_RS,			/* jr rs */
+	OPERANDS_RT_IMM,		/* lui rt immediate */
+	OPERANDS_NONE,			/* nop */
+	OPERANDS_RD_RS,			/* move rd rs */
+	OPERANDS_OFFSET,		/* b offset-or-label */
+	OPERANDS_RT_CONSTANT,	/* li rt constant */
+	OPERANDS_RT_ADDRESS,	/* la rt address-or-label */
+};
+
+static const unsigned char nr_operands[] = {
+	[OPERANDS_RD_RS_RT] = 3,
+	[OPERANDS_RD_RT_SHAMT] = 3,
+	[OPERANDS_RT_RS_IMM] = 3,
+	[OPERANDS_RT_RS_OFFSET] = 3,
+	[OPERANDS_TARGET] = 1,
+	[OPERANDS_RS] = 1,
+	[OPERANDS_RT_IMM] = 2,
+	[OPERANDS_NONE] = 0,
+	[OPERANDS_RD_RS] = 2,
+	[OPERANDS_OFFSET] = 1,
+	[OPERANDS_RT_CONSTANT] = 2,
+	[OPERANDS_RT_ADDRESS] = 2,
+};
+
+/* Most words a single line of assembly turns into */
+#define MAX_EXPANSION	2
+
+/**
+ * Perfect hashing of mnemonics and register names
+ *
+ * Every mnemonic and register name is at most 4 characters long, so a name
+ * is packed into a 32-bit key with its first character in the lowest byte.
+ * NAME_SLOT() multiplies the key by NAME_HASH_MAGIC and keeps the top
+ * NAME_HASH_BITS bits, and NAME_HASH_MAGIC is chosen so that no two
+ * mnemonics and no two register names end up in the same slot. The tables
+ * below are laid out by the compiler with designated initializers, so a
+ * lookup is a multiplication plus one comparison of the keys.
+ *
+ * A name that collides with another would silently take over its slot, so
+ * the names are listed once in INSTRUCTIONS() and REGISTERS() and the build
+ * fails on a collision (see NAMES_COLLIDE()); NAME_HASH_MAGIC then has to be
+ * replaced.
+ */
+#define NAME_HASH_MAGIC	0x1eee2a9bu
+#define NAME_HASH_BITS	6
+#define NAME_SLOTS		(1 << NAME_HASH_BITS)
+
+#define NAME_KEY(a, b, c, d) \
+	((unsigned int)(unsigned char)(a) | ((unsigned int)(unsigned char)(b) << 8) | \
+	 ((unsigned int)(unsigned char)(c) << 16) | ((unsigned int)(unsigned char)(d) << 24))
+#define NAME_SLOT(key)	((unsigned int)((key) * NAME_HASH_MAGIC) >> (32 - NAME_HASH_BITS))
+
+/**
+ * Bit of the slot of @key among the 32 slots starting at @first. Adding up
+ * the bits of all names gives their union only if no slot is taken twice,
+ * and 32 bits at a time the sum cannot overflow.
+ */
+#define NAME_SLOT_BIT(key, first) \
+	((NAME_SLOT(key) & ~31u) == (first) ? 1ull << (NAME_SLOT(key) & 31) : 0ull)
+#define NAMES_COLLIDE(list, add, or) \
+	((0ull list(add##_0)) != (0ull list(or##_0)) || (0ull list(add##_32)) != (0ull list(or##_32)))
+
+_Static_assert(NAME_SLOTS <= 64, "NAMES_COLLIDE() only covers 64 slots");
+
+/* Pack @name into a key. Returns 0 if @name is empty or too long */
+static inline unsigned int name_key(const char* name)
+{
+	unsigned int key = 0;
+
+	for (int i = 0; name[i]; i++) {
+		if (i == 4) return 0;
+		key |= (unsigned int)(unsigned char)name[i] << (8 * i);
+	}
+	return key;
+}
+
+/**
+ * Encoding of an instruction. R-format instructions have @opcode 0 and are
+ * told apart by @funct, while the others are told apart by @opcode only.
+ * Pseudo-instructions that stand for a single instruction carry the
+ * encoding of that instruction.
+ */
+struct instruction_desc {
+	unsigned int key;
+	const char* name;
+	unsigned char opcode;
+	unsigned char funct;
+	unsigned char layout;
+};
+
+#define INSTRUCTIONS(X) \
+	X("add",	NAME_KEY('a', 'd', 'd', 0),		0x00, 0x20, OPERANDS_RD_RS_RT) \
+	X("sub",	NAME_KEY('s', 'u', 'b', 0),		0x00, 0x22, OPERANDS_RD_RS_RT) \
+	X("and",	NAME_KEY('a', 'n', 'd', 0),		0x00, 0x24, OPERANDS_RD_RS_RT) \
+	X("or",	NAME_KEY('o', 'r', 0, 0),		0x00, 0x25, OPERANDS_RD_RS_RT) \
+	X("nor",	NAME_KEY('n', 'o', 'r', 0),		0x00, 0x27, OPERANDS_RD_RS_RT) \
+	X("sll",	NAME_KEY('s', 'l', 'l', 0),		0x00, 0x00, OPERANDS_RD_RT_SHAMT) \
+	X("srl",	NAME_KEY('s', 'r', 'l', 0),		0x00, 0x02, OPERANDS_RD_RT_SHAMT) \
+	X("sra",	NAME_KEY('s', 'r', 'a', 0),		0x00, 0x03, OPERANDS_RD_RT_SHAMT) \
+	X("addi",	NAME_KEY('a', 'd', 'd', 'i'),	0x08, 0x00, OPERANDS_RT_RS_IMM) \
+	X("andi",	NAME_KEY('a', 'n', 'd', 'i'),	0x0c, 0x00, OPERANDS_RT_RS_IMM) \
+	X("ori",	NAME_KEY('o', 'r', 'i', 0),		0x0d, 0x00, OPERANDS_RT_RS_IMM) \
+	X("lw",	NAME_KEY('l', 'w', 0, 0),		0x23, 0x00, OPERANDS_RT_RS_IMM) \
+	X("sw",	NAME_KEY('s', 'w', 0, 0),		0x2b, 0x00, OPERANDS_RT_RS_IMM) \
+	X("beq",	NAME_KEY('b', 'e', 'q', 0),		0x04, 0x00, OPERANDS_RT_RS_OFFSET) \
+	X("bne",	NAME_KEY('b', 'n', 'e', 0),		0x05, 0x00, OPERANDS_RT_RS_OFFSET) \
+	X("j",	NAME_KEY('j', 0, 0, 0),			0x02, 0x00, OPERANDS_TARGET) \
+	X("jal",	NAME_KEY('j', 'a', 'l', 0),		0x03, 0x00, OPERANDS_TARGET) \
+	X("slt",	NAME_KEY('s', 'l', 't', 0),		0x00, 0x2a, OPERANDS_RD_RS_RT) \
+	X("slti",	NAME_KEY('s', 'l', 't', 'i'),	0x0a, 0x00, OPERANDS_RT_RS_IMM) \
+	X("jr",	NAME_KEY('j', 'r', 0, 0),		0x00, 0x08, OPERANDS_RS) \
+	X("lui",	NAME_KEY('l', 'u', 'i', 0),		0x0f, 0x00, OPERANDS_RT_IMM) \
+	/* Pseudo-instructions */ \
+	X("nop",	NAME_KEY('n', 'o', 'p', 0),		0x00, 0x00, OPERANDS_NONE)	/* sll zero zero 0 */ \
+	X("move",	NAME_KEY('m', 'o', 'v', 'e'),	0x00, 0x20, OPERANDS_RD_RS)	/* add rd rs zero */ \
+	X("b",	NAME_KEY('b', 0, 0, 0),			0x04, 0x00, OPERANDS_OFFSET)	/* beq zero zero */ \
+	X("li",	NAME_KEY('l', 'i', 0, 0),		0x00, 0x00, OPERANDS_RT_CONSTANT) \
+	X("la",	NAME_KEY('l', 'a', 0, 0),		0x00, 0x00, OPERANDS_RT_ADDRESS)
+
+#define INSTRUCTION(name, key, opcode, funct, layout) \
+	[NAME_SLOT(key)] = { key, name, opcode, funct, layout },
+#define INSTRUCTION_ADD_0(name, key, ...)	+ NAME_SLOT_BIT(key, 0)
+#define INSTRUCTION_ADD_32(name, key, ...)	+ NAME_SLOT_BIT(key, 32)
+#define INSTRUCTION_OR_0(name, key, ...)	| NAME_SLOT_BIT(key, 0)
+#define INSTRUCTION_OR_32(name, key, ...)	| NAME_SLOT_BIT(key, 32)
+
+_Static_assert(!NAMES_COLLIDE(INSTRUCTIONS, INSTRUCTION_ADD, INSTRUCTION_OR),
+	"Two mnemonics hash to the same slot; replace NAME_HASH_MAGIC");
+
+static const struct instruction_desc instruction_descs[NAME_SLOTS] = {
+	INSTRUCTIONS(INSTRUCTION)
+};
+
+struct register_desc {
+	unsigned int key;
+	unsigned char number;
+};
+
+#define REGISTERS(X) \
+	X('z', 'e', 'r', 'o', 0) \
+	X('z', 'r', 0, 0, 0)	/* As PA2 calls it */ \
+	X('a', 't', 0, 0, 1) \
+	X('v', '0', 0, 0, 2)  X('v', '1', 0, 0, 3) \
+	X('a', '0', 0, 0, 4)  X('a', '1', 0, 0, 5) \
+	X('a', '2', 0, 0, 6)  X('a', '3', 0, 0, 7) \
+	X('t', '0', 0, 0, 8)  X('t', '1', 0, 0, 9) \
+	X('t', '2', 0, 0, 10) X('t', '3', 0, 0, 11) \
+	X('t', '4', 0, 0, 12) X('t', '5', 0, 0, 13) \
+	X('t', '6', 0, 0, 14) X('t', '7', 0, 0, 15) \
+	X('s', '0', 0, 0, 16) X('s', '1', 0, 0, 17) \
+	X('s', '2', 0, 0, 18) X('s', '3', 0, 0, 19) \
+	X('s', '4', 0, 0, 20) X('s', '5', 0, 0, 21) \
+	X('s', '6', 0, 0, 22) X('s', '7', 0, 0, 23) \
+	X('t', '8', 0, 0, 24) X('t', '9', 0, 0, 25) \
+	X('k', '0', 0, 0, 26) X('k', '1', 0, 0, 27) \
+	X('g', 'p', 0, 0, 28) X('s', 'p', 0, 0, 29) \
+	X('f', 'p', 0, 0, 30) X('r', 'a', 0, 0, 31)
+
+#define REGISTER(a, b, c, d, number) \
+	[NAME_SLOT(NAME_KEY(a, b, c, d))] = { NAME_KEY(a, b, c, d), number },
+#define REGISTER_ADD_0(a, b, c, d, number)	+ NAME_SLOT_BIT(NAME_KEY(a, b, c, d), 0)
+#define REGISTER_ADD_32(a, b, c, d, number)	+ NAME_SLOT_BIT(NAME_KEY(a, b, c, d), 32)
+#define REGISTER_OR_0(a, b, c, d, number)	| NAME_SLOT_BIT(NAME_KEY(a, b, c, d), 0)
+#define REGISTER_OR_32(a, b, c, d, number)	| NAME_SLOT_BIT(NAME_KEY(a, b, c, d), 32)
+
+_Static_assert(!NAMES_COLLIDE(REGISTERS, REGISTER_ADD, REGISTER_OR),
+	"Two register names hash to the same slot; replace NAME_HASH_MAGIC");
+
+static const struct register_desc register_descs[NAME_SLOTS] = {
+	REGISTERS(REGISTER)
+};
+
+static const struct instruction_desc* find_instruction(const char* name)
+{
+	unsigned int key = name_key(name);
+	const struct instruction_desc* desc = &instruction_descs[NAME_SLOT(key)];
+
+	return (key && desc->key == key) ? desc : NULL;
+}
+
+/**
+ * Find the number of register @name. The name may be prefixed with '$', and
+ * registers may also be given by number as in "$8".
+ *
+ * RETURN VALUE
+ *   The register number (0 -- 31), or -EINVAL if there is no such register
+ */
+static int find_register(const char* name)
+{
+	unsigned int key;
+	const struct register_desc* desc;
+
+	if (name[0] == '$') {
+		name++;
+		if (isdigit((unsigned char)name[0])) {
+			int number = name[0] - '0';
+
+			if (name[1] && (number == 0 || !isdigit((unsigned char)name[1]) || name[2])) return -EINVAL;
+			if (name[1]) number = number * 10 + name[1] - '0';
+
+			return number < 32 ? number : -EINVAL;
+		}
+	}
+
+	key = name_key(name);
+	desc = &register_descs[NAME_SLOT(key)];
+
+	return (key && desc->key == key) ? desc->number : -EINVAL;
+}
+
+/**
+ * Numbers are decimal unless they are written as "0x~~" or "-0x~~", in which
+ * case they are hexadecimal
+ */
+static long parse_immediate(const char* token)
+{
+	/* strtoll() so that 32-bit constants such as 0xffffffff are not clamped where long is 32 bits */
+	if (token[0] && (token[1] == 'x' || (token[1] && token[2] == 'x'))) {
+		return (long)strtoll(token, NULL, 16);
+	}
+	return (long)strtoll(token, NULL, 10);
+}
+
+
+/***********************************************************************
+ * Symbol table
+ *
+ * Labels are kept in an open-addressing hash table with linear probing.
+ * The table only points to the label names, which live in the source text
+ * being assembled, and it is grown to keep it at most half full.
+ */
+struct symbol {
+	const char* name;	/* NULL if the slot is empty */
+	unsigned int addr;
+	size_t statement;	/* Index of the statement the label is put in front of */
+};
+
+struct symtab {
+	struct symbol* symbols;
+	unsigned int size;	/* Number of slots; a power of two */
+	unsigned int nr_symbols;
+};
+
+/* FNV-1a */
+static unsigned int symbol_hash(const char* name)
+{
+	unsigned int hash = 2166136261u;
+
+	while (*name) {
+		hash = (hash ^ (unsigned char)*name++) * 16777619u;
+	}
+	return hash;
+}
+
+/* Returns the slot holding @name, or the empty slot where it would go */
+static struct symbol* symtab_slot(const struct symtab* symtab, const char* name)
+{
+	unsigned int i = symbol_hash(name) & (symtab->size - 1);
+
+	while (symtab->symbols[i].name && strcmp(symtab->symbols[i].name, name)) {
+		i = (i + 1) & (symtab->size - 1);
+	}
+	return &symtab->symbols[i];
+}
+
+static const struct symbol* find_symbol(const struct symtab* symtab, const char* name)
+{
+	const struct symbol* symbol;
+
+	if (!symtab || !symtab->size) return NULL;
+
+	symbol = symtab_slot(symtab, name);
+	return symbol->name ? symbol : NULL;
+}
+
+static int symtab_grow(struct symtab* symtab)
+{
+	struct symtab bigger = { NULL, symtab->size ? symtab->size * 2 : 256, symtab->nr_symbols };
+
+	bigger.symbols = calloc(bigger.size, sizeof(*bigger.symbols));
+	if (!bigger.symbols) return -ENOMEM;
+
+	for (unsigned int i = 0; i < symtab->size; i++) {
+		if (symtab->symbols[i].name) {
+			*symtab_slot(&bigger, symtab->symbols[i].name) = symtab->symbols[i];
+		}
+	}
+	free(symtab->symbols);
+	*symtab = bigger;
+
+	return 0;
+}
+
+/**
+ * Define label @name in front of statement @statement. Its address is known
+ * once the program is laid out.
+ *
+ * RETURN VALUE
+ *   0 on success, -EEXIST if @name is already defined, or -ENOMEM
+ */
+static int symtab_insert(struct symtab* symtab, const char* name, size_t statement)
+{
+	struct symbol* symbol;
+
+	if ((symtab->nr_symbols + 1) * 2 > symtab->size) {
+		int ret = symtab_grow(symtab);
+		if (ret) return ret;
+	}
+
+	symbol = symtab_slot(symtab, name);
+	if (symbol->name) return -EEXIST;
+
+	symbol->name = name;
+	symbol->addr = 0;
+	symbol->statement = statement;
+	symtab->nr_symbols++;
+
+	return 0;
+}
+
+static void symtab_destroy(struct symtab* symtab)
+{
+	free(symtab->symbols);
+	symtab->symbols = NULL;
+	symtab->size = symtab->nr_symbols = 0;
+}
+
+/**
+ * Resolve the branch or jump target in @token into an address. The target
+ * is either a number or the name of a label in @symtab.
+ *
+ * RETURN VALUE
+ *   1 if @token is a number, which is put into @value as is
+ *   0 if @token is a label, whose address is put into @value
+ *   -ENXIO if @token names no known label
+ */
+static int resolve_target(const char* token, const struct symtab* symtab, long* value)
+{
+	const struct symbol* symbol;
+
+	if (isdigit((unsigned char)token[0]) || token[0] == '-') {
+		*value = parse_immediate(token);
+		return 1;
+	}
+
+	symbol = find_symbol(symtab, token);
+	if (!symbol) return -ENXIO;
+
+	*value = symbol->addr;
+	return 0;
+}
+
 /***********************************************************************
  * translate()
  *
  * DESCRIPTION
- *   Translate assembly represented in @tokens[] into a MIPS instruction.
- *   This translate should support following 13 assembly commands
+ *   Translate assembly represented in @tokens[] into MIPS instructions,
+ *   and put them into @machine_code[]. This translate should support
+ *   following 21 assembly commands
  *
  *    - add
  *    - addi
@@ -56,212 +432,197 @@ typedef unsigned char bool;
  *    - sll
  *    - srl
  *    - sra
+ *    - slt
+ *    - slti
+ *    - lui
  *    - beq
  *    - bne
+ *    - jr
+ *    - j
+ *    - jal
+ *
+ *   and following pseudo-instructions
+ *
+ *    - nop             : sll zero zero 0
+ *    - move rd rs      : add rd rs zero
+ *    - b target        : beq zero zero target
+ *    - li rt constant  : the shortest of addi, ori, lui, and lui + ori
+ *    - la rt address   : the same as li, with the address of a label
+ *
+ *   The format, opcode, funct, and operand order of each command are listed
+ *   in @instruction_descs[] above, and the fields are packed into the word
+ *   with R_FORMAT(), I_FORMAT(), and J_FORMAT() from encoder.h. Programs
+ *   that already have the fields at hand can pack them in bulk with
+ *   encode_fields() from there instead.
+ *
+ *   translate() encodes a single line on its own, so branch offsets and jump
+ *   addresses have to be numbers. translate_at() encodes the instruction
+ *   placed at @addr, and also takes branch and jump targets as labels
+ *   defined in @symtab. Both only read their arguments, so they may run on
+ *   several threads at once.
  *
  * RETURN VALUE
- *   Return a 32-bit MIPS instruction
+ *   The number of words put into @machine_code[] (1 -- MAX_EXPANSION)
+ *   -ENOENT if @tokens[0] is not a known command
+ *   -EINVAL if the operands are missing or name unknown registers
+ *   -ENXIO if a branch or jump target is not a known label
+ *   -ERANGE if a branch target is too far away
  *
  */
 
-// 레지스터 이름에 해당하는 비트를 변환하는 함수
-static unsigned int getRegisterBit(char* token) {
-	if (strcmp(token, "zero") == 0) return 0;
-	if (strcmp(token, "at") == 0) return 1;
-	if (strcmp(token, "v0") == 0) return 2;
-	if (strcmp(token, "v1") == 0) return 3;
-	if (strcmp(token, "a0") == 0) return 4;
-	if (strcmp(token, "a1") == 0) return 5;
-	if (strcmp(token, "a2") == 0) return 6;
-	if (strcmp(token, "a3") == 0) return 7;
-	if (strcmp(token, "t0") == 0) return 8;
-	if (strcmp(token, "t1") == 0) return 9;
-	if (strcmp(token, "t2") == 0) return 10;
-	if (strcmp(token, "t3") == 0) return 11;
-	if (strcmp(token, "t4") == 0) return 12;
-	if (strcmp(token, "t5") == 0) return 13;
-	if (strcmp(token, "t6") == 0) return 14;
-	if (strcmp(token, "t7") == 0) return 15;
-	if (strcmp(token, "s0") == 0) return 16;
-	if (strcmp(token, "s1") == 0) return 17;
-	if (strcmp(token, "s2") == 0) return 18;
-	if (strcmp(token, "s3") == 0) return 19;
-	if (strcmp(token, "s4") == 0) return 20;
-	if (strcmp(token, "s5") == 0) return 21;
-	if (strcmp(token, "s6") == 0) return 22;
-	if (strcmp(token, "s7") == 0) return 23;
-	if (strcmp(token, "t8") == 0) return 24;
-	if (strcmp(token, "t9") == 0) return 25;
-	if (strcmp(token, "k1") == 0) return 26;
-	if (strcmp(token, "k2") == 0) return 27;
-	if (strcmp(token, "gp") == 0) return 28;
-	if (strcmp(token, "sp") == 0) return 29;
-	if (strcmp(token, "fp") == 0) return 30;
-	if (strcmp(token, "ra") == 0) return 31;
+/* Put the offset from the branch at @addr to @token into @offset */
+static int branch_offset(const char* token, unsigned int addr, const struct symtab* symtab, long* offset)
+{
+	int ret = resolve_target(token, symtab, offset);
+
+	if (ret < 0) return ret;
+	if (ret == 0) { /* Labels are relative to the instruction after the branch */
+		*offset = ((long)*offset - (long)(addr + 4)) / 4;
+		if (*offset < -32768 || *offset > 32767) return -ERANGE;
+	}
+	return 0;
 }
 
-// 비트를 자릿수에 맞춰서 문자열로 변환하는 함수
-static void getBitToString(int value, int n, char* str) {
-	char bitString[20];
-	int c = 0;
-	int index = 0;
+/**
+ * Load @value into register @rt with as few instructions as possible. Only
+ * its low 32 bits matter, so 0xffffffff loads the same as -1 whatever the
+ * width of long.
+ */
+static int load_constant(int rt, long value, unsigned int machine_code[])
+{
+	unsigned int word = (unsigned int)value;
+	int32_t v = (int32_t)word;
 
-	for (int i = n - 1; i >= 0; i--) {
-		c = (value & (1 << i)) >> i;
-		bitString[index] = c + '0'; //오른쪽부터 i+1번째 자리의 수, 정수를 문자로 변환
-		index++;
+	if (v >= -32768 && v <= 32767) {
+		machine_code[0] = I_FORMAT(0x08, 0, rt, word);			/* addi rt zero value */
+		return 1;
+	}
+	if (word <= 0xffff) {
+		machine_code[0] = I_FORMAT(0x0d, 0, rt, word);			/* ori rt zero value */
+		return 1;
 	}
-	bitString[n] = '\0';
-	strcpy(str, bitString);
 
-	return;
+	machine_code[0] = I_FORMAT(0x0f, 0, rt, word >> 16);		/* lui rt upper */
+	if ((word & 0xffff) == 0) return 1;
+
+	machine_code[1] = I_FORMAT(0x0d, rt, rt, word & 0xffff);	/* ori rt rt lower */
+	return 2;
 }
 
-static unsigned int translate(int nr_tokens, char* tokens[])
+static int translate_at(int nr_tokens, char* tokens[], unsigned int addr,
+	const struct symtab* symtab, unsigned int machine_code[])
 {
-	/* TODO:
-	 * This is an example MIPS instruction. You should change it accordingly.
-	 */
-
-	 // translate tokens into bits -> 레지스터 이름에 맞는 비트로 변환
-	 // and merge them to produce one 32-bit machine instruction. -> 포맷별로 merge 자리 배치
-
-	 // MIPS R-format Instructions : opcode(6 bits) + rs(5 bits) + rt(5 bits) + rd(5 bits) + shamt(5 bits) + funct(6 bits)
-	 // MIPS I-format Instructions : opcode(6 bits) + rs(5 bits) + rt(5 bits) + constant or address(16 bits)
-
-	 // 인덱스 1부터 3까지 tokens[]의 각 인덱스에 해당하는 토큰을 비트로 바꾼다.
-	 // 해당 포맷에 맞게 자리 배치해서 토큰들의 비트를 합친다.
-	 // 합친 2진수 32 bits를 16진수로 바꾼다.
-
-	bool iFormat = false;
-	char opcode[7] = { 0 };
-	char rs[6] = { 0 };
-	char rt[6] = { 0 };
-	char rd[6] = { 0 };
-	char shamt[6] = { 0 };
-	char consOrAddr[17] = { 0 };
-	char funct[7] = { 0 };
-	char result[33] = { 0 };
-	unsigned int resultValue = 0;
-
-	// 첫 인덱스의 토큰을 통해 포맷을 결정한다.
-	if (strcmp(tokens[0], "addi") == 0 || strcmp(tokens[0], "andi") == 0 || strcmp(tokens[0], "ori") == 0 ||
-		strcmp(tokens[0], "lw") == 0 || strcmp(tokens[0], "sw") == 0 || strcmp(tokens[0], "beq") == 0 || strcmp(tokens[0], "bne") == 0) {
-		iFormat = true;
-	}
-
-	if (!iFormat) { // R-format인 경우
-		// opcode(6 bits) + rs(5 bits) + rt(5 bits) + rd(5 bits) + shamt(5 bits) + funct(6 bits) 할당
-		getBitToString(0, 6, opcode);
-		if (strcmp(tokens[0], "add") == 0 || strcmp(tokens[0], "sub") == 0 || 
-			strcmp(tokens[0], "and") == 0 || strcmp(tokens[0], "or") == 0 || strcmp(tokens[0], "nor") == 0) {
-			getBitToString(getRegisterBit(tokens[1]), 5, rd);
-			getBitToString(getRegisterBit(tokens[2]), 5, rs);
-			getBitToString(getRegisterBit(tokens[3]), 5, rt);
-			getBitToString(0, 5, shamt);
-		}
-		if (strcmp(tokens[0], "add") == 0) {
-			getBitToString(0x20, 6, funct);
-		}
-		if (strcmp(tokens[0], "sub") == 0) {
-			getBitToString(0x22, 6, funct);
-		}
-		if (strcmp(tokens[0], "and") == 0) {
-			getBitToString(0x24, 6, funct);
-		}
-		if (strcmp(tokens[0], "or") == 0) {
-			getBitToString(0x25, 6, funct);
-		}
-		if (strcmp(tokens[0], "nor") == 0) {
-			getBitToString(0x27, 6, funct);
-		}
-		if (strcmp(tokens[0], "sll") == 0 || strcmp(tokens[0], "srl") == 0 || strcmp(tokens[0], "sra") == 0) {
-			getBitToString(0, 5, rs);
-			getBitToString(getRegisterBit(tokens[1]), 5, rd);
-			getBitToString(getRegisterBit(tokens[2]), 5, rt);
-			if (tokens[3][1] == 'x' || tokens[3][2] == 'x') { //"0x~~" or "-0x~~"임 -> 16진수인 경우
-				getBitToString(strtol(tokens[3], NULL, 16), 5, shamt);
-			}
-			else { //10진수인 경우
-				getBitToString(strtol(tokens[3], NULL, 10), 5, shamt);
-			}
-		}
-		if (strcmp(tokens[0], "sll") == 0) {
-			getBitToString(0x00, 6, funct);
-		}
-		if (strcmp(tokens[0], "srl") == 0) {
-			getBitToString(0x02, 6, funct);
-		}
-		if (strcmp(tokens[0], "sra") == 0) {
-			getBitToString(0x03, 6, funct);
-		}
-		// 비트열 합치기 -> 문자열 연결
-		// opcode(6 bits) + rs(5 bits) + rt(5 bits) + rd(5 bits) + shamt(5 bits) + funct(6 bits)
-		sprintf(result, "%s%s%s%s%s%s", opcode, rs, rt, rd, shamt, funct); //문자열을 연결시킨 출력값을 result에 저장한다.
-	}
-	
-	if (iFormat) { // I-format인 경우
-		// opcode(6 bits) + rs(5 bits) + rt(5 bits) + constant or address(16 bits) 할당
-		getBitToString(getRegisterBit(tokens[1]), 5, rt);
-		getBitToString(getRegisterBit(tokens[2]), 5, rs);
-		if (tokens[3][1] == 'x' || tokens[3][2] == 'x') { //"0x~~" or "-0x~~"임 -> 16진수인 경우
-			getBitToString(strtol(tokens[3], NULL, 16), 16, consOrAddr);
-		}
-		else { //10진수인 경우
-			getBitToString(strtol(tokens[3], NULL, 10), 16, consOrAddr);
-		}
+	const struct instruction_desc* desc = find_instruction(tokens[0]);
+	int rd, rs, rt, ret;
+	long target;
 
-		if (strcmp(tokens[0], "addi") == 0) {
-			getBitToString(0x08, 6, opcode);
-		}
-		if (strcmp(tokens[0], "andi") == 0) {
-			getBitToString(0x0c, 6, opcode);
-		}
-		if (strcmp(tokens[0], "ori") == 0) {
-			getBitToString(0x0d, 6, opcode);
-		}
-		if (strcmp(tokens[0], "lw") == 0) {
-			getBitToString(0x23, 6, opcode);
-		}
-		if (strcmp(tokens[0], "sw") == 0) {
-			getBitToString(0x2b, 6, opcode);
-		}
-		if (strcmp(tokens[0], "beq") == 0) {
-			getBitToString(0x04, 6, opcode);
-		}
-		if (strcmp(tokens[0], "bne") == 0) {
-			getBitToString(0x05, 6, opcode);
-		}
+	if (!desc) return -ENOENT;
+	if (nr_tokens != 1 + nr_operands[desc->layout]) return -EINVAL;
 
-		// 비트열 합치기 -> 문자열 연결
-		// opcode(6 bits) + rs(5 bits) + rt(5 bits) + constant or address(16 bits)
-		sprintf(result, "%s%s%s%s", opcode, rs, rt, consOrAddr);
-	}
+	switch (desc->layout) {
+	case OPERANDS_RD_RS_RT:
+		rd = find_register(tokens[1]);
+		rs = find_register(tokens[2]);
+		rt = find_register(tokens[3]);
+		if (rd < 0 || rs < 0 || rt < 0) return -EINVAL;
 
-	/*if (!iFormat) {
-		printf("r-format입니다.\n");
-		printf("opcode(6 bits): %s\n", opcode);
-		printf("rs(5 bits): %s\n", rs);
-		printf("rt(5 bits): %s\n", rt);
-		printf("rd(5 bits): %s\n", rd);
-		printf("shamt(5 bits): %s\n", shamt);
-		printf("funct(6 bits): %s\n", funct);
-	}
-	else {
-		printf("i-format입니다.\n");
-		printf("opcode(6 bits): %s\n", opcode);
-		printf("rs(5 bits): %s\n", rs);
-		printf("rt(5 bits): %s\n", rt);
-		printf("constant or address(16 bits): %s\n", consOrAddr);
-	}
-	printf("result>>>>>>>>%s\n", result);*/
+		machine_code[0] = R_FORMAT(desc->opcode, rs, rt, rd, 0, desc->funct);
+		break;
+	case OPERANDS_RD_RT_SHAMT:
+		rd = find_register(tokens[1]);
+		rt = find_register(tokens[2]);
+		if (rd < 0 || rt < 0) return -EINVAL;
+
+		machine_code[0] = R_FORMAT(desc->opcode, 0, rt, rd,
+			(unsigned int)parse_immediate(tokens[3]), desc->funct);
+		break;
+	case OPERANDS_RT_RS_IMM:
+		rt = find_register(tokens[1]);
+		rs = find_register(tokens[2]);
+		if (rt < 0 || rs < 0) return -EINVAL;
+
+		machine_code[0] = I_FORMAT(desc->opcode, rs, rt, (unsigned int)parse_immediate(tokens[3]));
+		break;
+	case OPERANDS_RT_RS_OFFSET:
+		rt = find_register(tokens[1]);
+		rs = find_register(tokens[2]);
+		if (rt < 0 || rs < 0) return -EINVAL;
+
+		ret = branch_offset(tokens[3], addr, symtab, &target);
+		if (ret < 0) return ret;
+
+		machine_code[0] = I_FORMAT(desc->opcode, rs, rt, (unsigned int)target);
+		break;
+	case OPERANDS_TARGET:
+		ret = resolve_target(tokens[1], symtab, &target);
+		if (ret < 0) return ret;
+
+		machine_code[0] = J_FORMAT(desc->opcode, (unsigned int)target);
+		break;
+	case OPERANDS_RS:
+		rs = find_register(tokens[1]);
+		if (rs < 0) return -EINVAL;
+
+		machine_code[0] = R_FORMAT(desc->opcode, rs, 0, 0, 0, desc->funct);
+		break;
+	case OPERANDS_RT_IMM:
+		rt = find_register(tokens[1]);
+		if (rt < 0) return -EINVAL;
+
+		machine_code[0] = I_FORMAT(desc->opcode, 0, rt, (unsigned int)parse_immediate(tokens[2]));
+		break;
+	case OPERANDS_NONE:
+		machine_code[0] = R_FORMAT(desc->opcode, 0, 0, 0, 0, desc->funct);
+		break;
+	case OPERANDS_RD_RS:
+		rd = find_register(tokens[1]);
+		rs = find_register(tokens[2]);
+		if (rd < 0 || rs < 0) return -EINVAL;
+
+		machine_code[0] = R_FORMAT(desc->opcode, rs, 0, rd, 0, desc->funct);
+		break;
+	case OPERANDS_OFFSET:
+		ret = branch_offset(tokens[1], addr, symtab, &target);
+		if (ret < 0) return ret;
+
+		machine_code[0] = I_FORMAT(desc->opcode, 0, 0, (unsigned int)target);
+		break;
+	case OPERANDS_RT_CONSTANT:
+		rt = find_register(tokens[1]);
+		if (rt < 0 || !(isdigit((unsigned char)tokens[2][0]) || tokens[2][0] == '-')) return -EINVAL;
 
-	// 32bits result 문자열을 숫자로 바꿔서 리턴한다.
-	resultValue = strtol(result, NULL, 2);
+		return load_constant(rt, parse_immediate(tokens[2]), machine_code);
+	case OPERANDS_RT_ADDRESS:
+		rt = find_register(tokens[1]);
+		if (rt < 0) return -EINVAL;
 
-	return resultValue;
+		ret = resolve_target(tokens[2], symtab, &target);
+		if (ret < 0) return ret;
+
+		return load_constant(rt, target, machine_code);
+	}
+	return 1;
 }
 
+static int translate(int nr_tokens, char* tokens[], unsigned int machine_code[])
+{
+	return translate_at(nr_tokens, tokens, 0, NULL, machine_code);
+}
+
+/* Describe the error translate() returned, to be followed by the command */
+static const char* translate_error(int ret)
+{
+	switch (ret) {
+	case -ENOENT:
+		return "Unknown instruction";
+	case -ENXIO:
+		return "Undefined label in";
+	case -ERANGE:
+		return "Branch target out of range in";
+	default:
+		return "Invalid operands for";
+	}
+}
 
 /***********************************************************************
  * parse_command()
@@ -286,7 +647,8 @@ static unsigned int translate(int nr_tokens, char* tokens[])
  *
  *
  * RETURN VALUE
- *   Return 0 after filling in @nr_tokens and @tokens[] properly
+ *   Return 0 after filling in @nr_tokens and @tokens[] properly, or -EINVAL
+ *   if @assembly has more than MAX_NR_TOKENS tokens
  *
  */
 static int parse_command(char* assembly, int* nr_tokens, char* tokens[])
@@ -302,6 +664,7 @@ static int parse_command(char* assembly, int* nr_tokens, char* tokens[])
 		}
 		else {
 			if (!token_started) {
+				if (*nr_tokens == MAX_NR_TOKENS) return -EINVAL;
 				tokens[*nr_tokens] = curr;
 				*nr_tokens += 1;
 				token_started = true;
@@ -314,25 +677,540 @@ static int parse_command(char* assembly, int* nr_tokens, char* tokens[])
 }
 
 
+/***********************************************************************
+ * Buffered output
+ *
+ * stderr is unbuffered, so printing each machine code with fprintf() costs
+ * a write system call per instruction. With the -b option, machine codes are
+ * formatted into @output and written to stderr a whole buffer at a time.
+ */
+#define OUTPUT_SIZE	(1 << 16)
+
+static char output[OUTPUT_SIZE];
+static size_t output_len = 0;
+
+static void flush_output(void)
+{
+	fwrite(output, 1, output_len, stderr);
+	output_len = 0;
+}
+
+/* Same as fprintf(stderr, "0x%08x\n", @machine_code), but into @output */
+static void emit_machine_code(unsigned int machine_code)
+{
+	static const char hex[] = "0123456789abcdef";
+	char* p;
+
+	if (output_len + 11 > sizeof(output)) flush_output();
+
+	p = output + output_len;
+	p[0] = '0';
+	p[1] = 'x';
+	for (int i = 0; i < 8; i++) {
+		p[2 + i] = hex[(machine_code >> (28 - 4 * i)) & 0xf];
+	}
+	p[10] = '\n';
+	output_len += 11;
+}
+
+
+/***********************************************************************
+ * Batch assembly
+ *
+ * With the -o option, the whole source file is read into memory and
+ * assembled in two passes. The first pass tokenizes every line in place,
+ * records which statement each label is in front of, and keeps the
+ * instructions as statements. The statements are then laid out to give
+ * every statement and label its address. The second pass encodes the
+ * statements with translate_at() into a contiguous image of big-endian
+ * words right behind room for the image header (see image.h), and the
+ * whole image is then written out with a single fwrite().
+ *
+ * In the source, a label is a token ending with ':' in front of an
+ * instruction or on a line of its own, and comments start with '#' or "//".
+ * The first instruction is placed at INITIAL_PC.
+ *
+ * Once the labels are known, every statement encodes on its own into its
+ * own words of the image. So with -j, pass 2 splits the statements into
+ * contiguous ranges and encodes them on worker threads at once.
+ */
+struct statement {
+	unsigned int lineno;
+	unsigned int addr;
+	unsigned char nr_words;		/* Words reserved for the statement */
+	bool relaxed;				/* Whether @nr_words depends on the layout */
+	int nr_tokens;
+	char* tokens[4];	/* Mnemonic and up to three operands */
+};
+
+struct program {
+	const char* filename;
+	char* source;
+	size_t source_len;
+	struct statement* statements;
+	size_t nr_statements;
+	size_t max_statements;
+	struct symtab symtab;
+	unsigned int end;		/* Address right after the last statement */
+	unsigned char* image;	/* Header and payload */
+	size_t image_len;
+};
+
+/* Read all of @input into @program->source, NUL-terminated */
+static int read_source(FILE* input, struct program* program)
+{
+	size_t size = 1 << 16, len = 0;
+	char* source = malloc(size);
+
+	if (!source) return -ENOMEM;
+
+	while (true) {
+		size_t n;
+
+		if (size - len < 2) {
+			char* bigger = realloc(source, size * 2);
+			if (!bigger) {
+				free(source);
+				return -ENOMEM;
+			}
+			source = bigger;
+			size *= 2;
+		}
+		n = fread(source + len, 1, size - len - 1, input);
+		if (n == 0) break;
+		len += n;
+	}
+	if (ferror(input)) {
+		free(source);
+		return -EIO;
+	}
+	source[len] = '\0';
+
+	program->source = source;
+	program->source_len = len;
+
+	return 0;
+}
+
+static int add_statement(struct program* program, unsigned int lineno, int nr_tokens, char* tokens[])
+{
+	const struct instruction_desc* desc;
+	struct statement* statement;
+
+	if (program->nr_statements == program->max_statements) {
+		size_t max = program->max_statements ? program->max_statements * 2 : 1024;
+		struct statement* bigger = realloc(program->statements, max * sizeof(*bigger));
+
+		if (!bigger) return -ENOMEM;
+		program->statements = bigger;
+		program->max_statements = max;
+	}
+
+	desc = find_instruction(tokens[0]);
+
+	statement = &program->statements[program->nr_statements++];
+	statement->lineno = lineno;
+	statement->addr = 0;
+	statement->nr_words = 1;
+	statement->relaxed = desc && (desc->layout == OPERANDS_RT_CONSTANT || desc->layout == OPERANDS_RT_ADDRESS);
+	statement->nr_tokens = nr_tokens;
+	memcpy(statement->tokens, tokens, nr_tokens * sizeof(*tokens));
+
+	return 0;
+}
+
+/* Chop @line at the start of its comment, if any */
+static void strip_comment(char* line)
+{
+	for (char* p = line; *p; p++) {
+		if (*p == '#' || (p[0] == '/' && p[1] == '/')) {
+			*p = '\0';
+			return;
+		}
+	}
+}
+
+/**
+ * Pass 1: split the source into statements and define the labels.
+ *
+ * RETURN VALUE
+ *   0 on success, -EINVAL if the source has errors, which are reported on
+ *   stderr, or -ENOMEM
+ */
+static int scan_program(struct program* program)
+{
+	char* line = program->source;
+	unsigned int lineno = 0;
+	int errors = 0;
+
+	while (line < program->source + program->source_len) {
+		char* end = strchr(line, '\n');
+		char* tokens[MAX_NR_TOKENS];
+		int nr_tokens = 0, first = 0;
+
+		if (end) *end = '\0';
+		lineno++;
+
+		strip_comment(line);
+		for (char* p = line; *p; p++) {
+			*p = tolower((unsigned char)*p);
+		}
+
+		if (parse_command(line, &nr_tokens, tokens) < 0) {
+			fprintf(stderr, "%s:%u: Too many tokens\n", program->filename, lineno);
+			errors++;
+			nr_tokens = 0;
+		}
+
+		for (; first < nr_tokens; first++) {
+			size_t len = strlen(tokens[first]);
+			int ret;
+
+			if (tokens[first][len - 1] != ':') break;
+			tokens[first][len - 1] = '\0';
+
+			if (len == 1 || isdigit((unsigned char)tokens[first][0]) || tokens[first][0] == '-') {
+				fprintf(stderr, "%s:%u: Invalid label %s:\n", program->filename, lineno, tokens[first]);
+				errors++;
+				continue;
+			}
+
+			ret = symtab_insert(&program->symtab, tokens[first], program->nr_statements);
+			if (ret == -ENOMEM) return ret;
+			if (ret == -EEXIST) {
+				fprintf(stderr, "%s:%u: Label %s is already defined\n", program->filename, lineno, tokens[first]);
+				errors++;
+			}
+		}
+
+		nr_tokens -= first;
+		if (nr_tokens > 4) {
+			fprintf(stderr, "%s:%u: %s: %s\n", program->filename, lineno,
+				translate_error(-EINVAL), tokens[first]);
+			errors++;
+		}
+		else if (nr_tokens > 0) {
+			if (add_statement(program, lineno, nr_tokens, tokens + first)) return -ENOMEM;
+		}
+
+		if (!end) break;
+		line = end + 1;
+	}
+
+	return errors ? -EINVAL : 0;
+}
+
+/**
+ * Lay the statements out from INITIAL_PC, and give each label its address.
+ *
+ * li and la take one or two words depending on their constant, and the
+ * address a la loads depends on the layout in turn. So every statement
+ * starts out with one word, and the ones that turn out to need more are
+ * grown until no statement changes. Statements never shrink, so this ends;
+ * one that ends up with a spare word is padded with a nop.
+ */
+static void layout_program(struct program* program)
+{
+	struct symtab* symtab = &program->symtab;
+	bool changed = true;
+
+	while (changed) {
+		unsigned int addr = INITIAL_PC;
+
+		for (size_t i = 0; i < program->nr_statements; i++) {
+			program->statements[i].addr = addr;
+			addr += 4 * program->statements[i].nr_words;
+		}
+		program->end = addr;
+
+		for (unsigned int i = 0; i < symtab->size; i++) {
+			struct symbol* symbol = &symtab->symbols[i];
+
+			if (!symbol->name) continue;
+			symbol->addr = symbol->statement < program->nr_statements ?
+				program->statements[symbol->statement].addr : program->end;
+		}
+
+		changed = false;
+		for (size_t i = 0; i < program->nr_statements; i++) {
+			struct statement* statement = &program->statements[i];
+			unsigned int machine_code[MAX_EXPANSION];
+			int nr_words;
+
+			if (!statement->relaxed) continue;
+
+			/* Errors are left for pass 2 to report */
+			nr_words = translate_at(statement->nr_tokens, statement->tokens,
+				statement->addr, symtab, machine_code);
+			if (nr_words > statement->nr_words) {
+				statement->nr_words = nr_words;
+				changed = true;
+			}
+		}
+	}
+}
+
+/**
+ * Encode statements @from to @to - 1 into their words in the image. Only
+ * reads @program apart from those words, so ranges that do not overlap can
+ * be encoded at the same time. Errors are reported on stderr if @report.
+ *
+ * RETURN VALUE
+ *   The number of statements that cannot be encoded
+ */
+static size_t encode_range(struct program* program, size_t from, size_t to, bool report)
+{
+	unsigned char* payload = program->image + IMAGE_HEADER_SIZE;
+	size_t errors = 0;
+
+	for (size_t i = from; i < to; i++) {
+		struct statement* statement = &program->statements[i];
+		unsigned char* words = payload + (statement->addr - INITIAL_PC);
+		unsigned int machine_code[MAX_EXPANSION];
+		int ret;
+
+		ret = translate_at(statement->nr_tokens, statement->tokens,
+			statement->addr, &program->symtab, machine_code);
+		if (ret < 0) {
+			if (report) {
+				fprintf(stderr, "%s:%u: %s: %s\n", program->filename, statement->lineno,
+					translate_error(ret), statement->tokens[0]);
+			}
+			errors++;
+			continue;
+		}
+
+		for (int j = 0; j < statement->nr_words; j++) {
+			put_be32(words + 4 * j, j < ret ? machine_code[j] : 0);	/* nop */
+		}
+	}
+	return errors;
+}
+
+#ifndef _WIN32
+#define MIN_STATEMENTS_PER_THREAD	4096
+
+struct encode_work {
+	pthread_t thread;
+	struct program* program;
+	size_t from, to;
+	size_t errors;
+};
+
+static void* encode_worker(void* arg)
+{
+	struct encode_work* work = arg;
+
+	work->errors = encode_range(work->program, work->from, work->to, false);
+	return NULL;
+}
+
+/**
+ * Encode all statements with @nr_threads threads, the calling one included.
+ * Returns the number of statements that cannot be encoded, without
+ * reporting them.
+ */
+static size_t encode_parallel(struct program* program, int nr_threads)
+{
+	size_t nr = program->nr_statements;
+	struct encode_work* works;
+	size_t errors = 0;
+
+	if ((size_t)nr_threads > nr / MIN_STATEMENTS_PER_THREAD) nr_threads = (int)(nr / MIN_STATEMENTS_PER_THREAD);
+	if (nr_threads < 2) return encode_range(program, 0, nr, false);
+
+	works = calloc(nr_threads, sizeof(*works));
+	if (!works) return encode_range(program, 0, nr, false);
+
+	for (int i = 0; i < nr_threads; i++) {
+		works[i].program = program;
+		works[i].from = nr * i / nr_threads;
+		works[i].to = nr * (i + 1) / nr_threads;
+	}
+
+	/* Ranges whose thread cannot be started are encoded by this thread */
+	for (int i = 1; i < nr_threads; i++) {
+		if (pthread_create(&works[i].thread, NULL, encode_worker, &works[i])) {
+			works[i].program = NULL;
+		}
+	}
+	encode_worker(&works[0]);
+
+	for (int i = 0; i < nr_threads; i++) {
+		if (i && works[i].program) {
+			pthread_join(works[i].thread, NULL);
+		}
+		else if (i) {
+			works[i].errors = encode_range(program, works[i].from, works[i].to, false);
+		}
+		errors += works[i].errors;
+	}
+	free(works);
+
+	return errors;
+}
+#endif
+
+/**
+ * Pass 2: encode the statements into @program->image with @nr_threads
+ * threads, and fill in the image header.
+ *
+ * RETURN VALUE
+ *   0 on success, -EINVAL if some statements cannot be encoded, which are
+ *   reported on stderr, or -ENOMEM
+ */
+static int encode_program(struct program* program, int nr_threads)
+{
+	struct image_header header;
+	unsigned char* payload;
+	size_t errors;
+
+	program->image_len = IMAGE_HEADER_SIZE + (program->end - INITIAL_PC);
+	program->image = malloc(program->image_len);
+	if (!program->image) return -ENOMEM;
+	payload = program->image + IMAGE_HEADER_SIZE;
+
+#ifdef _WIN32
+	errors = encode_range(program, 0, program->nr_statements, true);
+#else
+	if (nr_threads > 1) {
+		errors = encode_parallel(program, nr_threads);
+
+		/* Errors are rare; encode again in order to report them in order */
+		if (errors) encode_range(program, 0, program->nr_statements, true);
+	}
+	else {
+		errors = encode_range(program, 0, program->nr_statements, true);
+	}
+#endif
+	if (errors) return -EINVAL;
+
+	header.entry = INITIAL_PC;
+	header.load_addr = INITIAL_PC;
+	header.length = program->end - INITIAL_PC;
+	header.checksum = image_checksum(payload, header.length);
+	image_write_header(program->image, &header);
+
+	return 0;
+}
+
+static void release_program(struct program* program)
+{
+	free(program->source);
+	free(program->statements);
+	free(program->image);
+	symtab_destroy(&program->symtab);
+}
+
+/***********************************************************************
+ * assemble_file(input, filename, image, nr_threads)
+ *
+ * DESCRIPTION
+ *   Assemble the whole program in @input, which is called @filename in the
+ *   error messages, and write the image into the file @image. Statements
+ *   are encoded with @nr_threads threads.
+ *
+ * RETURN VALUE
+ *   0 on success, or a negative errno
+ */
+static int assemble_file(FILE* input, const char* filename, const char* image, int nr_threads)
+{
+	struct program program = { .filename = filename };
+	FILE* output;
+	int ret;
+
+	ret = read_source(input, &program);
+	if (ret) goto out;
+
+	ret = scan_program(&program);
+	if (ret) goto out;
+
+	layout_program(&program);
+
+	ret = encode_program(&program, nr_threads);
+	if (ret) goto out;
+
+	output = fopen(image, "wb");
+	if (!output) {
+		fprintf(stderr, "Cannot open %s\n", image);
+		ret = -errno;
+		goto out;
+	}
+	if (fwrite(program.image, 1, program.image_len, output) != program.image_len) ret = -EIO;
+	if (fclose(output) && !ret) ret = -EIO;
+	if (ret) fprintf(stderr, "Cannot write %s\n", image);
+
+out:
+	if (ret == -ENOMEM) fprintf(stderr, "Out of memory\n");
+	release_program(&program);
+	return ret;
+}
+
+
 /*====================================================================*/
 /*          ****** DO NOT MODIFY ANYTHING BELOW THIS LINE ******      */
 
 /***********************************************************************
  * The main function of this program.
+ *
+ *   pa1 [-b] [input file]
+ *   pa1 -o <image file> [-j threads] [input file]
+ *
+ *   -b : buffer the machine codes and write them out in large blocks
+ *   -o : assemble the whole input, resolving labels, and write the program
+ *        image into <image file>
+ *   -j : with -o, encode the instructions with @threads threads. The image
+ *        is the same as the one from a single thread
  */
 int main(int argc, char* const argv[])
 {
 	char assembly[MAX_ASSEMBLY] = { '\0' };
 	FILE* input = stdin;
+	bool buffered = false;
+	bool interactive;
+	const char* image = NULL;
+	const char* filename = NULL;
+	int nr_threads = 1;
 
-	if (argc > 1) {
-		input = fopen(argv[1], "r");
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-b") == 0) {
+			buffered = true;
+		}
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			image = argv[++i];
+		}
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+			nr_threads = atoi(argv[++i]);
+		}
+		else if (argv[i][0] == '-' || filename) {
+			fprintf(stderr, "Usage: %s [-b] [-o image file [-j threads]] [input file]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+		else {
+			filename = argv[i];
+		}
+	}
+
+	if (filename) {
+		input = fopen(filename, "r");
 		if (!input) {
-			fprintf(stderr, "No input file %s\n", argv[0]);
+			fprintf(stderr, "No input file %s\n", filename);
 			return EXIT_FAILURE;
 		}
 	}
 
+	if (image) {
+		int ret;
+
+#ifdef _WIN32
+		if (nr_threads > 1) fprintf(stderr, "-j is not supported on this platform; using a single thread\n");
+#endif
+		ret = assemble_file(input, filename ? filename : "<stdin>", image, nr_threads);
+
+		if (input != stdin) fclose(input);
+		return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
 	if (input == stdin) {
 		printf("*********************************************************\n");
 		printf("*          >> SCE212 MIPS translator  v0.10 <<          *\n");
@@ -349,11 +1227,16 @@ int main(int argc, char* const argv[])
 		printf(">> ");
 	}
 
+	/* Asked once, as isatty() is a system call */
+	interactive = input == stdin && isatty(fileno(stdin));
+
 	while (fgets(assembly, sizeof(assembly), input)) {
 		char* tokens[MAX_NR_TOKENS] = { NULL };
 		int nr_tokens = 0;
-		unsigned int machine_code;
+		unsigned int machine_code[MAX_EXPANSION];
+		int ret;
 
+		strip_comment(assembly);
 		for (size_t i = 0; i < strlen(assembly); i++) {
 			assembly[i] = tolower(assembly[i]);
 		}
@@ -361,13 +1244,30 @@ int main(int argc, char* const argv[])
 		if (parse_command(assembly, &nr_tokens, tokens) < 0)
 			continue;
 
-		machine_code = translate(nr_tokens, tokens);
-
-		fprintf(stderr, "0x%08x\n", machine_code);
+		if (nr_tokens == 0) {
+			/* Empty line; nothing to translate */
+		}
+		else if ((ret = translate(nr_tokens, tokens, machine_code)) < 0) {
+			if (buffered) flush_output();
+			fprintf(stderr, "%s: %s\n", translate_error(ret), tokens[0]);
+		}
+		else if (buffered) {
+			for (int i = 0; i < ret; i++) {
+				emit_machine_code(machine_code[i]);
+			}
+			if (interactive) flush_output();
+		}
+		else {
+			for (int i = 0; i < ret; i++) {
+				fprintf(stderr, "0x%08x\n", machine_code[i]);
+			}
+		}
 
 		if (input == stdin) printf(">> ");
 	}
 
+	if (buffered) flush_output();
+
 	if (input != stdin) fclose(input);
 
 	return EXIT_SUCCESS;
@@ -0,0 +1,881 @@
+/**********************************************************************
+ * Copyright (c) 2021-2022
+ *  Sang-Hoon Kim <sanghoonkim@ajou.ac.kr>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTIABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ **********************************************************************/
+
+/**
+ * Benchmark of the name lookups in the PA1 assembler.
+ *
+ * Builds pa1.c into this program (with its main() renamed) and looks up
+ * every token of a generated instruction stream, comparing the perfect-hash
+ * tables in pa1.c against the strcmp() chains pa1.c used before. For each
+ * lookup it reports ns and cycles per token, and checks that both find the
+ * same instructions and registers.
+ *
+ * Then it checks that 'li' picks the shortest encoding of constants that
+ * only fit in 16 bits once taken as 32-bit words, such as 0xffffffff.
+ *
+ * It also packs generated instruction fields with each encode_fields()
+ * kernel in encoder.h, and checks them against R_FORMAT() and friends.
+ *
+ * Finally it assembles a generated program end to end, both a line at a
+ * time as pa1 does by default and as a whole source file as pa1 -o does.
+ * It reports lines per second, ns per translate() call, and the number of
+ * allocations pa1.c makes, and checks every word against the program the
+ * generator encoded on its own. The corpus has a quarter as many lines as
+ * there are tokens, and the same arguments always generate the same one,
+ * so the numbers of different versions of pa1.c can be compared.
+ *
+ *   gcc -O2 -pthread -o pa1_bench pa1_bench.c
+ *   ./pa1_bench [million tokens]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+/* Count the allocations pa1.c makes */
+static unsigned long long nr_allocs = 0;
+
+static void* bench_malloc(size_t size)
+{
+	nr_allocs++;
+	return malloc(size);
+}
+
+static void* bench_calloc(size_t nmemb, size_t size)
+{
+	nr_allocs++;
+	return calloc(nmemb, size);
+}
+
+static void* bench_realloc(void* ptr, size_t size)
+{
+	nr_allocs++;
+	return realloc(ptr, size);
+}
+
+#define malloc bench_malloc
+#define calloc bench_calloc
+#define realloc bench_realloc
+
+#define main pa1_main
+#include "pa1.c"
+#undef main
+
+#undef malloc
+#undef calloc
+#undef realloc
+
+/**
+ * The lookups pa1.c had before the perfect-hash tables, kept here as the
+ * baseline. The mnemonic list is in the order pa1.c used to test them.
+ */
+static const char* const legacy_mnemonics[] = {
+	"add", "sub", "and", "or", "nor", "sll", "srl", "sra",
+	"addi", "andi", "ori", "lw", "sw", "beq", "bne",
+};
+
+/* Returns the index of @name in legacy_mnemonics[], or -EINVAL */
+static int legacy_find_instruction(const char* name)
+{
+	for (size_t i = 0; i < sizeof(legacy_mnemonics) / sizeof(*legacy_mnemonics); i++) {
+		if (strcmp(name, legacy_mnemonics[i]) == 0) return (int)i;
+	}
+	return -EINVAL;
+}
+
+static int legacy_find_register(const char* token)
+{
+	if (strcmp(token, "zero") == 0) return 0;
+	if (strcmp(token, "at") == 0) return 1;
+	if (strcmp(token, "v0") == 0) return 2;
+	if (strcmp(token, "v1") == 0) return 3;
+	if (strcmp(token, "a0") == 0) return 4;
+	if (strcmp(token, "a1") == 0) return 5;
+	if (strcmp(token, "a2") == 0) return 6;
+	if (strcmp(token, "a3") == 0) return 7;
+	if (strcmp(token, "t0") == 0) return 8;
+	if (strcmp(token, "t1") == 0) return 9;
+	if (strcmp(token, "t2") == 0) return 10;
+	if (strcmp(token, "t3") == 0) return 11;
+	if (strcmp(token, "t4") == 0) return 12;
+	if (strcmp(token, "t5") == 0) return 13;
+	if (strcmp(token, "t6") == 0) return 14;
+	if (strcmp(token, "t7") == 0) return 15;
+	if (strcmp(token, "s0") == 0) return 16;
+	if (strcmp(token, "s1") == 0) return 17;
+	if (strcmp(token, "s2") == 0) return 18;
+	if (strcmp(token, "s3") == 0) return 19;
+	if (strcmp(token, "s4") == 0) return 20;
+	if (strcmp(token, "s5") == 0) return 21;
+	if (strcmp(token, "s6") == 0) return 22;
+	if (strcmp(token, "s7") == 0) return 23;
+	if (strcmp(token, "t8") == 0) return 24;
+	if (strcmp(token, "t9") == 0) return 25;
+	if (strcmp(token, "k0") == 0) return 26;
+	if (strcmp(token, "k1") == 0) return 27;
+	if (strcmp(token, "gp") == 0) return 28;
+	if (strcmp(token, "sp") == 0) return 29;
+	if (strcmp(token, "fp") == 0) return 30;
+	if (strcmp(token, "ra") == 0) return 31;
+	return -EINVAL;
+}
+
+static const char* const register_names[] = {
+	"zero", "at", "v0", "v1", "a0", "a1", "a2", "a3",
+	"t0", "t1", "t2", "t3", "t4", "t5", "t6", "t7",
+	"s0", "s1", "s2", "s3", "s4", "s5", "s6", "s7",
+	"t8", "t9", "k0", "k1", "gp", "sp", "fp", "ra",
+};
+
+#define NR_MNEMONICS	(sizeof(legacy_mnemonics) / sizeof(*legacy_mnemonics))
+#define NR_REGISTERS	(sizeof(register_names) / sizeof(*register_names))
+
+static unsigned int seed = 212;
+
+static unsigned int rnd(unsigned int n)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline unsigned long long cycles(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* Opaque to the optimizer, so the lookups in the timed loops are not elided */
+static volatile unsigned long long sink;
+
+static void report(const char* name, size_t nr, int rounds, double elapsed, unsigned long long nr_cycles)
+{
+	printf("  %-28s %8.2f ns/token %8.2f cycles/token\n", name,
+		elapsed * 1e9 / ((double)nr * rounds), (double)nr_cycles / ((double)nr * rounds));
+}
+
+#define BENCH(name, tokens, nr, rounds, lookup) do {					\
+	unsigned long long sum = 0, started_cycles = cycles();			\
+	double started = now_sec();										\
+	for (int r = 0; r < (rounds); r++) {							\
+		for (size_t i = 0; i < (nr); i++) sum += (size_t)(lookup((tokens)[i]));	\
+	}																\
+	sink = sum;														\
+	report(name, nr, rounds, now_sec() - started, cycles() - started_cycles);	\
+} while (0)
+
+/**
+ * Time @fn packing @nr instructions of @fields into big-endian words, and
+ * compare the words against @expected. Returns the number of mismatches.
+ */
+static size_t bench_encoder(const char* name, encode_fields_fn fn, const struct instruction_fields* fields,
+	size_t nr, uint32_t* words, const uint32_t* expected)
+{
+	const int rounds = 10;
+	unsigned long long started_cycles = cycles();
+	double started = now_sec(), elapsed;
+	size_t mismatches = 0;
+
+	for (int r = 0; r < rounds; r++) {
+		fn(fields, 0, nr, words, 1);
+	}
+	elapsed = now_sec() - started;
+
+	printf("  %-28s %8.2f ns/word %8.2f cycles/word %8.2f GB/s\n", name,
+		elapsed * 1e9 / ((double)nr * rounds), (double)(cycles() - started_cycles) / ((double)nr * rounds),
+		4.0 * nr * rounds / elapsed / 1e9);
+
+	for (size_t i = 0; i < nr; i++) {
+		if (words[i] != expected[i]) mismatches++;
+	}
+	return mismatches;
+}
+
+static size_t bench_encoders(size_t nr)
+{
+	uint8_t* bytes = malloc(6 * nr);
+	uint32_t* immediates = malloc(nr * sizeof(*immediates));
+	uint32_t* expected = malloc(nr * sizeof(*expected));
+	uint32_t* words = malloc(nr * sizeof(*words));
+	struct instruction_fields fields;
+	size_t mismatches = 0;
+
+	if (!bytes || !immediates || !expected || !words) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	fields.opcode = bytes;
+	fields.rs = bytes + nr;
+	fields.rt = bytes + 2 * nr;
+	fields.rd = bytes + 3 * nr;
+	fields.shamt = bytes + 4 * nr;
+	fields.funct = bytes + 5 * nr;
+	fields.immediate = immediates;
+
+	/* A mix of R-, I-, and J-format instructions */
+	for (size_t i = 0; i < nr; i++) {
+		static const uint8_t opcodes[] = { 0, 0, 0, 0x08, 0x0d, 0x23, 0x2b, 0x04, 0x05, 0x02, 0x03 };
+		static const uint8_t functs[] = { 0x20, 0x22, 0x24, 0x25, 0x27, 0x00, 0x02, 0x03, 0x2a, 0x08 };
+		uint32_t word;
+
+		bytes[i] = opcodes[rnd(sizeof(opcodes))];
+		bytes[nr + i] = rnd(32);
+		bytes[2 * nr + i] = rnd(32);
+		bytes[3 * nr + i] = rnd(32);
+		bytes[4 * nr + i] = rnd(32);
+		bytes[5 * nr + i] = functs[rnd(sizeof(functs))];
+		immediates[i] = rnd(1 << 24) << 2;
+
+		word = encode_one(&fields, i);
+		expected[i] = to_byte_order(word, 1);
+	}
+
+	printf("\n%zu instruction words per round\n\n", nr);
+
+	mismatches += bench_encoder("encode_fields scalar", encode_fields_scalar, &fields, nr, words, expected);
+#ifdef ENCODER_SSE2
+	if (strcmp(__encode_fields_name, "scalar")) {
+		mismatches += bench_encoder("encode_fields sse2", encode_fields_sse2, &fields, nr, words, expected);
+	}
+#endif
+#ifdef ENCODER_AVX2
+	if (strcmp(__encode_fields_name, "avx2") == 0) {
+		mismatches += bench_encoder("encode_fields avx2", encode_fields_avx2, &fields, nr, words, expected);
+	}
+#endif
+
+	free(bytes);
+	free(immediates);
+	free(expected);
+	free(words);
+
+	return mismatches;
+}
+
+/**
+ * Generated assembly corpora
+ *
+ * A corpus is one random program rendered twice. @lines has an instruction
+ * a line with numeric branch offsets and jump addresses, as translate()
+ * takes them, now and then followed by a comment, and @source is the same program as a source file for the
+ * batch assembler, with labels to branch and jump to, comments, and blank
+ * lines. Every line is padded with runs of spaces and tabs, and mnemonics,
+ * registers, and immediates are spelled in all the ways pa1 accepts.
+ *
+ * @expected holds the words of the program, which the generator packs with
+ * plain shifts of its own rather than with R_FORMAT() and friends.
+ */
+#define LABEL_EVERY		16		/* Instructions from one label to the next */
+#define BRANCH_REACH	1024	/* Farthest a branch goes, in instructions */
+#define MAX_LINE		192
+
+enum gen_kind {
+	GEN_R,		/* add rd rs rt */
+	GEN_SHIFT,	/* sll rd rt shamt */
+	GEN_IMM,	/* addi rt rs signed */
+	GEN_UIMM,	/* ori rt rs unsigned */
+	GEN_MEM,	/* lw rt rs offset */
+	GEN_LUI,	/* lui rt unsigned */
+	GEN_BRANCH,	/* beq rt rs target */
+	GEN_JUMP,	/* j target */
+	GEN_JR,		/* jr rs */
+};
+
+/* How often each instruction turns up, roughly as in compiled code */
+static const struct gen_mnemonic {
+	const char* name;
+	unsigned char opcode, funct;
+	enum gen_kind kind;
+	unsigned int weight;
+} gen_mnemonics[] = {
+	{ "add",	0x00, 0x20, GEN_R,		8 },
+	{ "sub",	0x00, 0x22, GEN_R,		3 },
+	{ "and",	0x00, 0x24, GEN_R,		2 },
+	{ "or",		0x00, 0x25, GEN_R,		2 },
+	{ "nor",	0x00, 0x27, GEN_R,		1 },
+	{ "slt",	0x00, 0x2a, GEN_R,		3 },
+	{ "sll",	0x00, 0x00, GEN_SHIFT,	3 },
+	{ "srl",	0x00, 0x02, GEN_SHIFT,	2 },
+	{ "sra",	0x00, 0x03, GEN_SHIFT,	1 },
+	{ "addi",	0x08, 0x00, GEN_IMM,	10 },
+	{ "slti",	0x0a, 0x00, GEN_IMM,	2 },
+	{ "andi",	0x0c, 0x00, GEN_UIMM,	2 },
+	{ "ori",	0x0d, 0x00, GEN_UIMM,	3 },
+	{ "lui",	0x0f, 0x00, GEN_LUI,	2 },
+	{ "lw",		0x23, 0x00, GEN_MEM,	12 },
+	{ "sw",		0x2b, 0x00, GEN_MEM,	8 },
+	{ "beq",	0x04, 0x00, GEN_BRANCH,	4 },
+	{ "bne",	0x05, 0x00, GEN_BRANCH,	4 },
+	{ "j",		0x02, 0x00, GEN_JUMP,	2 },
+	{ "jal",	0x03, 0x00, GEN_JUMP,	2 },
+	{ "jr",		0x00, 0x08, GEN_JR,		1 },
+};
+
+#define NR_GEN_MNEMONICS	(sizeof(gen_mnemonics) / sizeof(*gen_mnemonics))
+
+static const char* const gen_comments[] = {
+	"# load the next element",
+	"#spill $ra, 0x10($sp)",
+	"// loop counter",
+	"//",
+	"# TODO: hoist out of the loop",
+	"## add t0 t1 t2",
+};
+
+#define NR_GEN_COMMENTS	(sizeof(gen_comments) / sizeof(*gen_comments))
+
+struct corpus {
+	char* lines;			/* NUL-terminated lines, one after another */
+	size_t* offsets;		/* Where each line starts in @lines */
+	char* source;
+	size_t source_len;
+	size_t nr_source_lines;
+	unsigned int* expected;
+	size_t nr;				/* Instructions, and lines in @lines */
+};
+
+static const struct gen_mnemonic* pick_mnemonic(void)
+{
+	static unsigned int total = 0;
+	unsigned int n;
+
+	if (!total) {
+		for (size_t i = 0; i < NR_GEN_MNEMONICS; i++) total += gen_mnemonics[i].weight;
+	}
+	n = rnd(total);
+	for (size_t i = 0; ; i++) {
+		if (n < gen_mnemonics[i].weight) return &gen_mnemonics[i];
+		n -= gen_mnemonics[i].weight;
+	}
+}
+
+/* Append @min to @min + 3 blanks, mostly spaces */
+static char* put_blanks(char* p, int min)
+{
+	for (int n = min + (int)rnd(4); n > 0; n--) {
+		*p++ = rnd(4) ? ' ' : '\t';
+	}
+	return p;
+}
+
+static char* put_str(char* p, const char* str)
+{
+	while (*str) *p++ = *str++;
+	return p;
+}
+
+/* Append @name, now and then in upper case */
+static char* put_name(char* p, const char* name)
+{
+	bool upper = rnd(8) == 0;
+
+	while (*name) {
+		*p++ = upper ? (char)toupper((unsigned char)*name) : *name;
+		name++;
+	}
+	return p;
+}
+
+static char* put_register(char* p, unsigned int reg)
+{
+	switch (rnd(4)) {
+	case 0:
+		return p + sprintf(p, "$%u", reg);
+	case 1:
+		*p++ = '$';
+		/* Fall through */
+	default:
+		return put_name(p, register_names[reg]);
+	}
+}
+
+/* Append @value in decimal or hexadecimal */
+static char* put_number(char* p, long value)
+{
+	if (rnd(2)) return p + sprintf(p, "%ld", value);
+	return p + sprintf(p, value < 0 ? "-0x%lx" : "0x%lx", value < 0 ? -value : value);
+}
+
+/* Mostly small immediates, as in real code, and now and then any 16-bit one */
+static long gen_immediate(bool is_signed)
+{
+	if (rnd(4)) return (long)rnd(512) - (is_signed ? 256 : 0);
+	return (long)rnd(65536) - (is_signed ? 32768 : 0);
+}
+
+/* A label within reach of instruction @i */
+static size_t gen_branch_target(size_t i, size_t nr)
+{
+	long last = (long)((nr - 1) / LABEL_EVERY);
+	long label = (long)(i / LABEL_EVERY) + (long)rnd(2 * BRANCH_REACH / LABEL_EVERY + 1) - BRANCH_REACH / LABEL_EVERY;
+
+	if (label < 0) label = 0;
+	if (label > last) label = last;
+	return (size_t)label * LABEL_EVERY;
+}
+
+/**
+ * Generate instruction @i of the @nr in the corpus. Put its operands for
+ * translate() into @operands, and the one to use in the source file
+ * instead of a numeric target into @label. Returns the instruction word.
+ */
+static unsigned int generate_instruction(size_t i, size_t nr, const struct gen_mnemonic** mnemonic,
+	char operands[3][32], int* nr_operands, char label[32])
+{
+	const struct gen_mnemonic* m = pick_mnemonic();
+	unsigned int rd = rnd(32), rs = rnd(32), rt = rnd(32);
+	unsigned int word = (unsigned int)m->opcode << 26;
+	long value;
+	size_t target;
+
+	*mnemonic = m;
+	*nr_operands = 0;
+	label[0] = '\0';
+
+	switch (m->kind) {
+	case GEN_R:
+		*put_register(operands[0], rd) = '\0';
+		*put_register(operands[1], rs) = '\0';
+		*put_register(operands[2], rt) = '\0';
+		*nr_operands = 3;
+		return word | rs << 21 | rt << 16 | rd << 11 | m->funct;
+	case GEN_SHIFT:
+		value = rnd(32);
+		*put_register(operands[0], rd) = '\0';
+		*put_register(operands[1], rt) = '\0';
+		*put_number(operands[2], value) = '\0';
+		*nr_operands = 3;
+		return word | rt << 16 | rd << 11 | (unsigned int)value << 6 | m->funct;
+	case GEN_IMM:
+	case GEN_UIMM:
+	case GEN_MEM:
+		value = m->kind == GEN_MEM ? gen_immediate(true) & ~3L : gen_immediate(m->kind == GEN_IMM);
+		*put_register(operands[0], rt) = '\0';
+		*put_register(operands[1], rs) = '\0';
+		*put_number(operands[2], value) = '\0';
+		*nr_operands = 3;
+		return word | rs << 21 | rt << 16 | ((unsigned int)value & 0xffff);
+	case GEN_LUI:
+		value = gen_immediate(false);
+		*put_register(operands[0], rt) = '\0';
+		*put_number(operands[1], value) = '\0';
+		*nr_operands = 2;
+		return word | rt << 16 | (unsigned int)value;
+	case GEN_BRANCH:
+		target = gen_branch_target(i, nr);
+		value = (long)target - (long)(i + 1);
+		*put_register(operands[0], rt) = '\0';
+		*put_register(operands[1], rs) = '\0';
+		*put_number(operands[2], value) = '\0';
+		*put_name(label, "l") = '\0';
+		sprintf(label + 1, "%zu", target);
+		*nr_operands = 3;
+		return word | rs << 21 | rt << 16 | ((unsigned int)value & 0xffff);
+	case GEN_JUMP:
+		target = (size_t)rnd((unsigned int)((nr - 1) / LABEL_EVERY + 1)) * LABEL_EVERY;
+		value = INITIAL_PC + 4 * (long)target;
+		*put_number(operands[0], value) = '\0';
+		*put_name(label, "l") = '\0';
+		sprintf(label + 1, "%zu", target);
+		*nr_operands = 1;
+		return word | (((unsigned int)value >> 2) & 0x3ffffff);
+	case GEN_JR:
+		*put_register(operands[0], rs) = '\0';
+		*nr_operands = 1;
+		return word | rs << 21 | m->funct;
+	}
+	return 0;
+}
+
+/* Append a line with @nr_operands operands, padded with blanks, to @p */
+static char* put_line(char* p, const struct gen_mnemonic* m, char operands[3][32], int nr_operands)
+{
+	p = put_blanks(p, 0);
+	p = put_name(p, m->name);
+	for (int i = 0; i < nr_operands; i++) {
+		p = put_blanks(p, 1);
+		p = put_str(p, operands[i]);
+	}
+	return put_blanks(p, 0);
+}
+
+static void release_corpus(struct corpus* c)
+{
+	free(c->lines);
+	free(c->offsets);
+	free(c->source);
+	free(c->expected);
+}
+
+static int generate_corpus(struct corpus* c, size_t nr)
+{
+	char* line;
+	char* source;
+
+	c->nr = nr;
+	c->nr_source_lines = 0;
+	c->lines = malloc(nr * MAX_LINE);
+	c->offsets = malloc(nr * sizeof(*c->offsets));
+	c->source = malloc(nr * 2 * MAX_LINE);
+	c->expected = malloc(nr * sizeof(*c->expected));
+	if (!c->lines || !c->offsets || !c->source || !c->expected) {
+		release_corpus(c);
+		return -ENOMEM;
+	}
+
+	line = c->lines;
+	source = c->source;
+	for (size_t i = 0; i < nr; i++) {
+		const struct gen_mnemonic* m;
+		char operands[3][32], label[32];
+		int nr_operands;
+
+		c->expected[i] = generate_instruction(i, nr, &m, operands, &nr_operands, label);
+
+		c->offsets[i] = line - c->lines;
+		line = put_line(line, m, operands, nr_operands);
+		if (rnd(4) == 0) line = put_str(line, gen_comments[rnd(NR_GEN_COMMENTS)]);
+		*line++ = '\n';
+		*line++ = '\0';
+
+		/* The source file branches to labels, and has comments and blank lines in between */
+		if (rnd(8) == 0) {
+			source = put_blanks(source, 0);
+			source = put_str(source, gen_comments[rnd(NR_GEN_COMMENTS)]);
+			*source++ = '\n';
+			c->nr_source_lines++;
+		}
+		if (rnd(16) == 0) {
+			source = put_blanks(source, 0);
+			*source++ = '\n';
+			c->nr_source_lines++;
+		}
+		if (i % LABEL_EVERY == 0) {
+			source = put_blanks(source, 0);
+			source = put_name(source, "l");
+			source += sprintf(source, "%zu:", i);
+			if (rnd(2)) {
+				*source++ = '\n';
+				c->nr_source_lines++;
+			}
+			else {
+				source = put_blanks(source, 1);
+			}
+		}
+		if (label[0]) strcpy(operands[nr_operands - 1], label);
+		source = put_line(source, m, operands, nr_operands);
+		if (rnd(4) == 0) source = put_str(source, gen_comments[rnd(NR_GEN_COMMENTS)]);
+		*source++ = '\n';
+		c->nr_source_lines++;
+	}
+	*source = '\0';
+	c->source_len = source - c->source;
+
+	return 0;
+}
+
+/**
+ * Translate @c a line at a time as the line mode of pa1 does; strip the
+ * comment, lower the case, split the tokens with parse_command(), and
+ * translate() them.
+ * Returns the number of lines translated to other words than expected.
+ */
+static size_t bench_line_mode(const struct corpus* c, int rounds)
+{
+	unsigned long long allocs = nr_allocs;
+	double started = now_sec(), elapsed;
+	size_t mismatches = 0;
+
+	for (int r = 0; r < rounds; r++) {
+		for (size_t i = 0; i < c->nr; i++) {
+			const char* line = c->lines + c->offsets[i];
+			char assembly[MAX_ASSEMBLY];
+			char* tokens[MAX_NR_TOKENS];
+			unsigned int machine_code[MAX_EXPANSION];
+			int nr_tokens;
+			size_t j;
+
+			for (j = 0; line[j]; j++) {
+				assembly[j] = (char)tolower((unsigned char)line[j]);
+			}
+			assembly[j] = '\0';
+
+			strip_comment(assembly);
+			if (parse_command(assembly, &nr_tokens, tokens) < 0 ||
+				translate(nr_tokens, tokens, machine_code) != 1 ||
+				machine_code[0] != c->expected[i]) mismatches++;
+		}
+	}
+	elapsed = now_sec() - started;
+
+	printf("  %-28s %8.2f ns/line %8.2f Mlines/s %8.2f allocs/line   %s\n", "parse_command + translate",
+		elapsed * 1e9 / ((double)c->nr * rounds), (double)c->nr * rounds / elapsed / 1e6,
+		(double)(nr_allocs - allocs) / ((double)c->nr * rounds), mismatches ? "MISMATCH" : "ok");
+
+	return mismatches;
+}
+
+/* Time translate() alone, on the lines of @c split into tokens beforehand */
+static size_t bench_translate(const struct corpus* c, int rounds)
+{
+	size_t size = c->offsets[c->nr - 1] + MAX_LINE;
+	char* text = malloc(size);
+	char* (*tokens)[4] = malloc(c->nr * sizeof(*tokens));
+	unsigned char* nr_tokens = malloc(c->nr);
+	unsigned long long allocs, started_cycles;
+	double started;
+	size_t mismatches = 0;
+
+	if (!text || !tokens || !nr_tokens) {
+		fprintf(stderr, "Out of memory\n");
+		free(text);
+		free(tokens);
+		free(nr_tokens);
+		return 1;
+	}
+	memcpy(text, c->lines, size);
+
+	for (size_t i = 0; i < c->nr; i++) {
+		char* line = text + c->offsets[i];
+		char* split[MAX_NR_TOKENS];
+		int nr;
+
+		strip_comment(line);
+		for (char* p = line; *p; p++) {
+			*p = (char)tolower((unsigned char)*p);
+		}
+		if (parse_command(line, &nr, split) < 0 || nr > 4) nr = 0;
+		memcpy(tokens[i], split, nr * sizeof(*split));
+		nr_tokens[i] = (unsigned char)nr;
+	}
+
+	allocs = nr_allocs;
+	started = now_sec();
+	started_cycles = cycles();
+	for (int r = 0; r < rounds; r++) {
+		for (size_t i = 0; i < c->nr; i++) {
+			unsigned int machine_code[MAX_EXPANSION];
+
+			if (translate(nr_tokens[i], tokens[i], machine_code) != 1 ||
+				machine_code[0] != c->expected[i]) mismatches++;
+		}
+	}
+	printf("  %-28s %8.2f ns/call %8.2f cycles/call %8.2f allocs/call   %s\n", "translate",
+		(now_sec() - started) * 1e9 / ((double)c->nr * rounds),
+		(double)(cycles() - started_cycles) / ((double)c->nr * rounds),
+		(double)(nr_allocs - allocs) / ((double)c->nr * rounds), mismatches ? "MISMATCH" : "ok");
+
+	free(text);
+	free(tokens);
+	free(nr_tokens);
+
+	return mismatches;
+}
+
+/**
+ * Assemble the source file of @c as pa1 -o -j @nr_threads does, short of
+ * reading and writing the files, and check the image it makes.
+ */
+static size_t bench_batch(const struct corpus* c, int nr_threads, int rounds)
+{
+	unsigned long long allocs = 0;
+	double elapsed = 0;
+	size_t mismatches = 0;
+	char name[32];
+
+	for (int r = 0; r < rounds; r++) {
+		struct program program = { .filename = "corpus" };
+		struct image_header header;
+		unsigned long long started_allocs = nr_allocs;
+		double started = now_sec();
+		int ret;
+
+		/* Stands in for read_source(), outside of the time */
+		program.source = malloc(c->source_len + 1);
+		if (!program.source) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+		memcpy(program.source, c->source, c->source_len + 1);
+		program.source_len = c->source_len;
+
+		ret = scan_program(&program);
+		if (!ret) {
+			layout_program(&program);
+			ret = encode_program(&program, nr_threads);
+		}
+		elapsed += now_sec() - started;
+		allocs += nr_allocs - started_allocs;
+
+		if (ret || image_read_header(program.image, program.image_len, &header) ||
+			header.length != 4 * c->nr ||
+			header.checksum != image_checksum(program.image + IMAGE_HEADER_SIZE, header.length)) {
+			mismatches++;
+		}
+		else {
+			for (size_t i = 0; i < c->nr; i++) {
+				if (get_be32(program.image + IMAGE_HEADER_SIZE + 4 * i) != c->expected[i]) mismatches++;
+			}
+		}
+		release_program(&program);
+	}
+
+	snprintf(name, sizeof(name), "batch -j %d", nr_threads);
+	printf("  %-28s %8.2f ns/line %8.2f Mlines/s %8.2f allocs/run    %s\n", name,
+		elapsed * 1e9 / ((double)c->nr_source_lines * rounds),
+		(double)c->nr_source_lines * rounds / elapsed / 1e6,
+		(double)allocs / rounds, mismatches ? "MISMATCH" : "ok");
+
+	return mismatches;
+}
+
+static size_t bench_corpus(size_t nr)
+{
+	struct corpus corpus;
+	size_t mismatches = 0;
+
+	if (generate_corpus(&corpus, nr)) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	printf("\n%zu instructions in %zu lines, %zu bytes of source\n\n",
+		corpus.nr, corpus.nr_source_lines, corpus.source_len);
+
+	mismatches += bench_line_mode(&corpus, 3);
+	mismatches += bench_translate(&corpus, 3);
+	mismatches += bench_batch(&corpus, 1, 3);
+#ifndef _WIN32
+	mismatches += bench_batch(&corpus, 4, 3);
+#endif
+
+	release_corpus(&corpus);
+
+	return mismatches;
+}
+
+/**
+ * 'li' with constants whose encoding depends on them being taken as 32
+ * bits, and the words it has to come out as
+ */
+static const struct {
+	const char* line;
+	int nr_words;
+	unsigned int words[MAX_EXPANSION];
+} li_cases[] = {
+	{ "li t0 -1",			1, { 0x2008ffff } },				/* addi t0 zero -1 */
+	{ "li t0 0xffffffff",	1, { 0x2008ffff } },
+	{ "li t1 -32768",		1, { 0x20098000 } },				/* addi t1 zero -32768 */
+	{ "li t1 0xffff8000",	1, { 0x20098000 } },
+	{ "li t2 0xffff",		1, { 0x340affff } },				/* ori t2 zero 0xffff */
+	{ "li t3 0x10000",		1, { 0x3c0b0001 } },				/* lui t3 0x0001 */
+	{ "li t4 0xffff7fff",	2, { 0x3c0cffff, 0x358c7fff } },	/* lui + ori */
+	{ "li t5 0x12345678",	2, { 0x3c0d1234, 0x35ad5678 } },
+};
+
+/* Returns the number of li_cases[] translated to other words than they should */
+static size_t check_load_constants(void)
+{
+	size_t mismatches = 0;
+
+	for (size_t i = 0; i < sizeof(li_cases) / sizeof(*li_cases); i++) {
+		char assembly[MAX_ASSEMBLY];
+		char* tokens[MAX_NR_TOKENS];
+		unsigned int machine_code[MAX_EXPANSION];
+		int nr_tokens, nr_words;
+
+		snprintf(assembly, sizeof(assembly), "%s", li_cases[i].line);
+		if (parse_command(assembly, &nr_tokens, tokens) < 0) {
+			mismatches++;
+			continue;
+		}
+		nr_words = translate(nr_tokens, tokens, machine_code);
+		if (nr_words != li_cases[i].nr_words ||
+			memcmp(machine_code, li_cases[i].words, nr_words * sizeof(*machine_code))) {
+			printf("%s: translated to %d words 0x%08x 0x%08x\n", li_cases[i].line, nr_words,
+				machine_code[0], nr_words > 1 ? machine_code[1] : 0);
+			mismatches++;
+		}
+	}
+	return mismatches;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t nr = (size_t)(argc > 1 ? atoi(argv[1]) : 1) << 20;
+	const char** mnemonics = malloc(nr * sizeof(*mnemonics));
+	const char** registers = malloc(nr * sizeof(*registers));
+	size_t mismatches = 0;
+
+	if (nr == 0 || !mnemonics || !registers) {
+		fprintf(stderr, "Usage: %s [million tokens]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Uniformly random names; a chain of strcmp()s suffers most for late entries */
+	for (size_t i = 0; i < nr; i++) {
+		mnemonics[i] = legacy_mnemonics[rnd(NR_MNEMONICS)];
+		registers[i] = register_names[rnd(NR_REGISTERS)];
+	}
+
+	for (size_t i = 0; i < NR_MNEMONICS; i++) {
+		const struct instruction_desc* desc = find_instruction(legacy_mnemonics[i]);
+
+		if (!desc || legacy_find_instruction(desc->name) != (int)i) mismatches++;
+	}
+	for (size_t i = 0; i < NR_REGISTERS; i++) {
+		char dollar[8], number[8];
+
+		snprintf(dollar, sizeof(dollar), "$%s", register_names[i]);
+		snprintf(number, sizeof(number), "$%zu", i);
+		if (find_register(register_names[i]) != legacy_find_register(register_names[i]) ||
+			find_register(dollar) != (int)i || find_register(number) != (int)i) mismatches++;
+	}
+
+	printf("%zu mnemonics, %zu registers per round\n\n", nr, nr);
+
+	BENCH("mnemonic strcmp chain", mnemonics, nr, 3, legacy_find_instruction);
+	BENCH("mnemonic perfect hash", mnemonics, nr, 3, find_instruction);
+	BENCH("register strcmp chain", registers, nr, 3, legacy_find_register);
+	BENCH("register perfect hash", registers, nr, 3, find_register);
+
+	encoder_select();
+	mismatches += bench_encoders(nr);
+	mismatches += bench_corpus(nr / 4);
+
+	if (find_instruction("addiu") || find_instruction("") || find_register("k2") >= 0 ||
+		find_register("$32") >= 0 || find_register("$07") >= 0) mismatches++;
+	mismatches += check_load_constants();
+
+	printf("\n%s\n", mismatches ? "MISMATCH" : "ok");
+
+	free(mnemonics);
+	free(registers);
+
+	return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -19,6 +19,16 @@
 #include <string.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <time.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#endif
+
+#include "../PA1/image.h"
 
  /*====================================================================*/
  /*          ****** DO NOT MODIFY ANYTHING FROM THIS LINE ******       */
@@ -39,9 +49,10 @@ const char* __color_start = "[1;32;40m";
 const char* __color_end = "[0m";
 
 /**
- * memory[] emulates the memory of the machine
+ * boot_memory[] is what the memory of the machine holds at 0x0000 0000 when
+ * it starts. The rest of the memory starts out zero.
  */
-static unsigned char memory[1 << 20] = {	/* 1MB memory at 0x0000 0000 -- 0x0100 0000 */
+static const unsigned char boot_memory[] = {
 	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
 	0xde, 0xad, 0xbe, 0xef, 0x00, 0x00, 0x00, 0x00,
 	'h',  'e',  'l',  'l',  'o',  ' ',  'w',  'o',
@@ -56,9 +67,9 @@ static unsigned char memory[1 << 20] = {	/* 1MB memory at 0x0000 0000 -- 0x0100
 #define INITIAL_SP	0x8000	/* Initial location for stack pointer */
 
 /**
- * Registers of the machine
+ * Registers of the machine when it starts
  */
-static unsigned int registers[32] = {
+static const unsigned int boot_registers[32] = {
 	0, 0, 0, 0, 0, 0, 0, 0,
 	0, 0, 0, 0, 0, 0, 0, 0,
 	0x10, INITIAL_PC, 0x20, 3, 0xbadacafe, 0xcdcdcdcd, 0xffffffff, 7,
@@ -75,11 +86,6 @@ const char* register_names[] = {
 	"t8", "t9", "k0", "k1", "gp", "sp", "fp", "ra"
 };
 
-/**
- * Program counter register
- */
-static unsigned int pc = INITIAL_PC;
-
 /**
  * strmatch()
  *
@@ -99,11 +105,476 @@ static inline bool strmatch(char* const str, const char* expect)
 /*          ****** DO NOT MODIFY ANYTHING UP TO THIS LINE ******      */
 /*====================================================================*/
 
+/**********************************************************************
+ * Memory
+ *
+ * The memory of the machine spans the whole 32-bit address space, in pages
+ * of PAGE_BYTES. A page is allocated, zero-filled, the first time the
+ * machine stores to it, so host memory follows the pages a program actually
+ * writes. Until then loads and fetches read the page as @zero_page, which
+ * all such pages share and no store goes to. The first page starts out
+ * with @boot_memory[] in it, so it is allocated on the first touch.
+ *
+ * The @page_table of a struct memory finds a page in two steps. The top
+ * DIR_BITS of an address pick one of its directories, and the next
+ * DIR_BITS the page in that directory. Directories are allocated along
+ * with their first page.
+ *
+ * A page may be in more than one page table, which is how snapshots share
+ * the memory with the machine (see take_snapshot() below). Such a page is
+ * read-only; the first store to it copies it, and the copy takes its place
+ * in the page table.
+ *
+ * In front of the page table, every slot of @tlb holds the last page touched
+ * whose page number falls into the slot: the address of the page as its
+ * tag, and where the page is on the host, less that address. The slot has
+ * a tag for stores as well, which is only set if the page is not shared.
+ * An access that hits the slot is a single lookup plus an offset; the
+ * others walk the page table and refill the slot.
+ *
+ * Words in the memory are big-endian, byte by byte, as the machine sees
+ * them. load_word() and store_word() access the word at @addr in one go
+ * with get_be32() and put_be32() from image.h. They check the tag with the
+ * two low bits of @addr kept in, so a word that is not aligned, and may
+ * straddle two pages, misses @tlb and takes the slow path.
+ */
+#define PAGE_BITS		12
+#define PAGE_BYTES		(1u << PAGE_BITS)
+#define DIR_BITS		10
+#define NR_DIR_PAGES	(1u << DIR_BITS)
+#define NR_DIRS			(1u << (32 - PAGE_BITS - DIR_BITS))
+
+struct page {
+	unsigned int refs;	/* How many page tables have the page */
+	unsigned char bytes[PAGE_BYTES];
+};
+
+struct page_table {
+	struct page** dirs[NR_DIRS];	/* NULL until a page in them is allocated */
+	size_t nr_pages;
+};
+
+#define NR_TLB			64
+#define TLB_EMPTY		4	/* No address looks up to it, as they keep bits 2 to 11 clear */
+
+#define TLB_BYTE_TAG(addr)	((addr) & ~(PAGE_BYTES - 1))
+#define TLB_WORD_TAG(addr)	((addr) & (~(PAGE_BYTES - 1) | 3))
+
+struct tlb_entry {
+	unsigned int tag;		/* Address of the page */
+	unsigned int write_tag;	/* The same if the page is not shared, TLB_EMPTY otherwise */
+	uintptr_t addend;		/* Host address of the page, less @tag */
+};
+
+struct memory {
+	struct page_table page_table;
+	struct tlb_entry tlb[NR_TLB];
+	unsigned long long tlb_misses;
+	unsigned long long cow_copies;	/* Shared pages copied on a store */
+};
+
+/* Keep the rare paths out of the accesses that inline the common one */
+#if defined(__GNUC__)
+#define COLD	__attribute__((noinline, cold))
+#else
+#define COLD
+#endif
+
+static void out_of_memory(unsigned int addr)
+{
+	fprintf(stderr, "Out of memory for the page at 0x%08x\n", addr & ~(PAGE_BYTES - 1));
+	exit(EXIT_FAILURE);
+}
+
+/* What the pages that are not there read as */
+static const struct page zero_page;
+
+/**
+ * Where @pt has the page of @addr. A page that is not there yet is
+ * allocated if @alloc or if it is the first page; otherwise this returns
+ * NULL, and the page reads as @zero_page.
+ */
+static struct page** walk_page_table(struct page_table* pt, unsigned int addr, bool alloc)
+{
+	struct page*** dir = &pt->dirs[addr >> (PAGE_BITS + DIR_BITS)];
+	struct page** page;
+
+	alloc = alloc || addr < PAGE_BYTES;
+	if (!*dir) {
+		if (!alloc) return NULL;
+		if (!(*dir = calloc(NR_DIR_PAGES, sizeof(**dir)))) out_of_memory(addr);
+	}
+
+	page = &(*dir)[(addr >> PAGE_BITS) % NR_DIR_PAGES];
+	if (!*page) {
+		if (!alloc) return NULL;
+		if (!(*page = calloc(1, sizeof(**page)))) out_of_memory(addr);
+		if (addr < PAGE_BYTES) memcpy((*page)->bytes, boot_memory, sizeof(boot_memory));
+		(*page)->refs = 1;
+		pt->nr_pages++;
+	}
+	return page;
+}
+
+static void put_page(struct page* page)
+{
+	if (page && --page->refs == 0) free(page);
+}
+
+static COLD unsigned char* tlb_fill(struct memory* mem, unsigned int addr, bool write)
+{
+	struct tlb_entry* e = &mem->tlb[(addr >> PAGE_BITS) % NR_TLB];
+	struct page** page = walk_page_table(&mem->page_table, addr, write);
+
+	if (write && (*page)->refs > 1) {
+		struct page* copy = malloc(sizeof(*copy));
+
+		if (!copy) out_of_memory(addr);
+		memcpy(copy->bytes, (*page)->bytes, PAGE_BYTES);
+		copy->refs = 1;
+		put_page(*page);
+		*page = copy;
+		mem->cow_copies++;
+	}
+
+	mem->tlb_misses++;
+	e->tag = TLB_BYTE_TAG(addr);
+	e->write_tag = page && (*page)->refs == 1 ? e->tag : TLB_EMPTY;
+	e->addend = (uintptr_t)(page ? (*page)->bytes : zero_page.bytes) - e->tag;
+	return (unsigned char*)(e->addend + addr);
+}
+
+static void flush_tlb(struct memory* mem)
+{
+	for (size_t i = 0; i < NR_TLB; i++) mem->tlb[i].tag = mem->tlb[i].write_tag = TLB_EMPTY;
+}
+
+/* Where the byte at @addr is on the host, to be written to if @write */
+static inline unsigned char* memory_at(struct memory* mem, unsigned int addr, bool write)
+{
+	const struct tlb_entry* e = &mem->tlb[(addr >> PAGE_BITS) % NR_TLB];
+
+	if ((write ? e->write_tag : e->tag) == TLB_BYTE_TAG(addr)) return (unsigned char*)(e->addend + addr);
+	return tlb_fill(mem, addr, write);
+}
+
+/* The words that miss @tlb; those that straddle two pages go byte by byte */
+static COLD unsigned int load_word_slow(struct memory* mem, unsigned int addr)
+{
+	if (addr % PAGE_BYTES <= PAGE_BYTES - 4) return get_be32(memory_at(mem, addr, false));
+
+	return ((unsigned int)*memory_at(mem, addr, false) << 24) | ((unsigned int)*memory_at(mem, addr + 1, false) << 16) |
+		((unsigned int)*memory_at(mem, addr + 2, false) << 8) | *memory_at(mem, addr + 3, false);
+}
+
+static COLD void store_word_slow(struct memory* mem, unsigned int addr, unsigned int value)
+{
+	if (addr % PAGE_BYTES <= PAGE_BYTES - 4) {
+		put_be32(memory_at(mem, addr, true), value);
+		return;
+	}
+	*memory_at(mem, addr, true) = value >> 24;
+	*memory_at(mem, addr + 1, true) = (value >> 16) & 0xff;
+	*memory_at(mem, addr + 2, true) = (value >> 8) & 0xff;
+	*memory_at(mem, addr + 3, true) = value & 0xff;
+}
+
+static inline unsigned int load_word(struct memory* mem, unsigned int addr)
+{
+	const struct tlb_entry* e = &mem->tlb[(addr >> PAGE_BITS) % NR_TLB];
+
+	if (e->tag != TLB_WORD_TAG(addr)) return load_word_slow(mem, addr);
+	return get_be32((const unsigned char*)(e->addend + addr));
+}
+
+static inline void store_word(struct memory* mem, unsigned int addr, unsigned int value)
+{
+	const struct tlb_entry* e = &mem->tlb[(addr >> PAGE_BITS) % NR_TLB];
+
+	if (e->write_tag != TLB_WORD_TAG(addr)) store_word_slow(mem, addr, value);
+	else put_be32((unsigned char*)(e->addend + addr), value);
+}
+
+/* Copy the @len bytes at @data to @addr of the memory */
+static void write_memory(struct memory* mem, unsigned int addr, const unsigned char* data, size_t len)
+{
+	while (len) {
+		size_t n = PAGE_BYTES - addr % PAGE_BYTES;
+
+		if (n > len) n = len;
+		memcpy(memory_at(mem, addr, true), data, n);
+		addr += (unsigned int)n;
+		data += n;
+		len -= n;
+	}
+}
+
+static void free_pages(struct page_table* pt)
+{
+	for (size_t i = 0; i < NR_DIRS; i++) {
+		if (!pt->dirs[i]) continue;
+		for (size_t j = 0; j < NR_DIR_PAGES; j++) put_page(pt->dirs[i][j]);
+		free(pt->dirs[i]);
+		pt->dirs[i] = NULL;
+	}
+	pt->nr_pages = 0;
+}
+
+/**
+ * Make @dst, which has no pages, have the pages of @src, without copying
+ * any of them. Each becomes shared, so flush the TLB whose memory @src is.
+ */
+static void share_pages(struct page_table* dst, const struct page_table* src)
+{
+	for (size_t i = 0; i < NR_DIRS; i++) {
+		if (!src->dirs[i]) continue;
+		if (!(dst->dirs[i] = malloc(NR_DIR_PAGES * sizeof(*dst->dirs[i])))) {
+			out_of_memory((unsigned int)(i * NR_DIR_PAGES) << PAGE_BITS);
+		}
+		memcpy(dst->dirs[i], src->dirs[i], NR_DIR_PAGES * sizeof(*dst->dirs[i]));
+		for (size_t j = 0; j < NR_DIR_PAGES; j++) {
+			if (dst->dirs[i][j]) dst->dirs[i][j]->refs++;
+		}
+	}
+	dst->nr_pages = src->nr_pages;
+}
+
+/* Whether @a and @b hold the same bytes. A page that is not there holds zeros */
+static bool same_pages(const struct page_table* a, const struct page_table* b)
+{
+	for (size_t i = 0; i < NR_DIRS; i++) {
+		if (!a->dirs[i] && !b->dirs[i]) continue;
+		for (size_t j = 0; j < NR_DIR_PAGES; j++) {
+			const struct page* pa = a->dirs[i] ? a->dirs[i][j] : NULL;
+			const struct page* pb = b->dirs[i] ? b->dirs[i][j] : NULL;
+
+			if (pa != pb && memcmp(pa ? pa->bytes : zero_page.bytes, pb ? pb->bytes : zero_page.bytes, PAGE_BYTES)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/**********************************************************************
+ * Predecoded instructions
+ *
+ * run_program() does not take an instruction word apart each time it runs
+ * the instruction. The first time it runs the word at an address, it
+ * decodes the word into the slot of @decoded[] for that address, and then
+ * runs the instruction from the slot, that time and every time after.
+ *
+ * A few pairs and triples of instructions that programs run all the time
+ * are fused into one slot (see decode_slot() below), which then depends on
+ * the words that follow it as well.
+ *
+ * Slots cover the first DECODED_BYTES of the memory, where programs are
+ * loaded. Code beyond it is fetched and run by process_instruction().
+ *
+ * A slot goes stale once its word in the memory changes. So every sw marks
+ * the slots of the words it writes, and the two slots before them, as
+ * undecoded again, and loading a program marks all of them. A machine
+ * keeps the range of slots decoded since then, so that marking all of
+ * them, and counting the fused ones at halt, only go over that range.
+ */
+enum decoded_op {
+	OP_UNDECODED = 0,
+	OP_HALT,
+	OP_NOP,		/* Unknown instructions, which do nothing */
+	OP_ADD, OP_SUB, OP_AND, OP_OR, OP_NOR,
+	OP_SLL, OP_SRL, OP_SRA, OP_SLT, OP_JR,
+	OP_J, OP_JAL,
+	OP_ADDI, OP_ANDI, OP_ORI, OP_LW, OP_SW,
+	OP_SLTI, OP_LUI, OP_BEQ, OP_BNE,
+
+	/* Fused instructions, which take the fields of the rest from the slots after them */
+	OP_LW_ADDI, OP_SLT_BNE, OP_SLT_BEQ, OP_SLL_ADD, OP_SLL_ADD_LW,
+	NR_OPS,
+};
+
+#define OP_FIRST_FUSED	OP_LW_ADDI
+
+struct decoded {
+	unsigned char op;	/* enum decoded_op */
+	unsigned char rs, rt, rd;
+	unsigned int imm;	/* Extended immediate, shift amount, or jump target */
+};
+
+#define DECODED_BYTES	(1u << 20)
+#define NR_DECODED		(DECODED_BYTES / 4)
+
+/* Mark the slots that depend on the word(s) written by a store to @addr as undecoded */
+static inline void invalidate_decoded(struct decoded* decoded, unsigned int addr)
+{
+	unsigned int last = (addr + 3) / 4 < NR_DECODED ? (addr + 3) / 4 : NR_DECODED - 1;
+
+	for (unsigned int i = addr / 4 >= 2 ? addr / 4 - 2 : 0; i <= last; i++) {
+		decoded[i].op = OP_UNDECODED;
+	}
+}
+
+
+/**********************************************************************
+ * Profiler
+ *
+ * While a machine has a @profile, run_program() hands the program to
+ * run_profiled() instead of its own loop. run_profiled() fetches and runs
+ * every word with process_instruction(), like the loop of the skeleton,
+ * and counts what it runs on the way; how many times each PC runs and
+ * how many times the branch there is taken, how many instructions of each
+ * opcode, or funct for R-format ones, run, and the loads and stores.
+ * Since it is a loop of its own, run_program() does not check anything
+ * per instruction for it, and profiling costs nothing while it is off.
+ *
+ * The counts per PC are kept in an open-addressing hash table keyed by
+ * the PC, which grows when it gets half full. It is emptied whenever
+ * run_profiled() starts over, so a profile covers one run.
+ */
+struct profile_entry {
+	unsigned int pc;
+	unsigned int instr;			/* The word run at @pc most recently */
+	unsigned long long count;	/* 0 if the entry is empty */
+	unsigned long long taken;	/* Times the branch at @pc went to its target */
+};
+
+struct profile {
+	struct profile_entry* entries;
+	size_t nr_entries;
+	size_t capacity;			/* A power of two, or 0 */
+	unsigned long long classes[128];	/* By opcode, and by 64 + funct for R-format */
+	unsigned long long nr_instructions;
+	unsigned long long branches, taken;
+	unsigned long long loads, stores;
+	char csv[MAX_COMMAND];		/* Where the report is written, or "" */
+};
+
+/* The opcode, or 64 + funct, that @instr is counted under */
+#define PROFILE_CLASS(instr)	((instr) >> 26 ? (instr) >> 26 : 64 + ((instr) & 0x3f))
+
+static void reset_profile(struct profile* p)
+{
+	if (p->entries) memset(p->entries, 0, p->capacity * sizeof(*p->entries));
+	p->nr_entries = 0;
+	memset(p->classes, 0, sizeof(p->classes));
+	p->nr_instructions = p->branches = p->taken = p->loads = p->stores = 0;
+}
+
+static inline size_t profile_slot(unsigned int pc, size_t capacity)
+{
+	return (size_t)((pc >> 2) * 2654435761u) & (capacity - 1);
+}
+
+static COLD void grow_profile(struct profile* p)
+{
+	size_t capacity = p->capacity ? p->capacity * 2 : 1024;
+	struct profile_entry* entries = calloc(capacity, sizeof(*entries));
+
+	if (!entries) {
+		fprintf(stderr, "Out of memory for the profile of %zu PCs\n", p->nr_entries);
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < p->capacity; i++) {
+		size_t j;
+
+		if (!p->entries[i].count) continue;
+		for (j = profile_slot(p->entries[i].pc, capacity); entries[j].count; j = (j + 1) & (capacity - 1));
+		entries[j] = p->entries[i];
+	}
+	free(p->entries);
+	p->entries = entries;
+	p->capacity = capacity;
+}
+
+/* The entry of @pc in @p, which is added if @pc has not run yet */
+static inline struct profile_entry* profile_entry(struct profile* p, unsigned int pc)
+{
+	size_t i;
+
+	if (2 * (p->nr_entries + 1) > p->capacity) grow_profile(p);
+
+	for (i = profile_slot(pc, p->capacity); p->entries[i].count; i = (i + 1) & (p->capacity - 1)) {
+		if (p->entries[i].pc == pc) return &p->entries[i];
+	}
+	p->entries[i].pc = pc;
+	p->nr_entries++;
+	return &p->entries[i];
+}
+
+static void release_profile(struct profile* p)
+{
+	if (!p) return;
+	free(p->entries);
+	free(p);
+}
+
+
+/**********************************************************************
+ * Machine
+ *
+ * A struct machine holds all that a program changes while it runs, and
+ * everything below works on the machine it is given. So any number of
+ * programs can be loaded and run side by side, each on its own machine.
+ * The commands of the terminal work on @machine.
+ */
+struct machine {
+	unsigned int registers[32];
+	unsigned int pc;
+	unsigned int entry_pc;		/* Where run_program() starts; images may ask for another entry point */
+	struct memory mem;
+	struct decoded* decoded;	/* NR_DECODED slots for the first DECODED_BYTES of @mem */
+	unsigned int decoded_first, decoded_last;	/* Slots decoded since the last flush_decoded(), if first <= last */
+	bool fusion_enabled;
+	unsigned long long fusion_counts[NR_OPS - OP_FIRST_FUSED];	/* How many times each fused op ran */
+	size_t fusion_sites[NR_OPS - OP_FIRST_FUSED];				/* Slots of each fused op when the last run halted */
+	struct profile* profile;	/* What run_program() counts, or NULL if it does not profile */
+};
+
+/**
+ * Set @m up as the machine is when it starts, with nothing loaded.
+ *
+ * RETURN VALUE
+ *   0 on success
+ *   -ENOMEM if @m cannot get its @decoded table
+ */
+static int machine_init(struct machine* m)
+{
+	memset(m, 0, sizeof(*m));
+	memcpy(m->registers, boot_registers, sizeof(m->registers));
+	m->pc = INITIAL_PC;
+	m->entry_pc = INITIAL_PC;
+	flush_tlb(&m->mem);
+	m->fusion_enabled = true;
+
+	m->decoded = calloc(NR_DECODED, sizeof(*m->decoded));
+	m->decoded_first = NR_DECODED;
+	return m->decoded ? 0 : -ENOMEM;
+}
+
+static void machine_exit(struct machine* m)
+{
+	free_pages(&m->mem.page_table);
+	free(m->decoded);
+	m->decoded = NULL;
+	release_profile(m->profile);
+	m->profile = NULL;
+}
+
+/* Mark all slots of @m->decoded as undecoded, which only those decoded since the last time are not */
+static void flush_decoded(struct machine* m)
+{
+	if (m->decoded_first <= m->decoded_last) {
+		memset(m->decoded + m->decoded_first, 0, (m->decoded_last - m->decoded_first + 1) * sizeof(*m->decoded));
+	}
+	m->decoded_first = NR_DECODED;
+	m->decoded_last = 0;
+}
+
+
 /**********************************************************************
  * process_instruction
  *
  * DESCRIPTION
- *   Execute the machine code given through @instr. The following table lists
+ *   Execute the machine code given through @instr on @m. The following table lists
  *   up the instructions to support. Note that a pseudo instruction 'halt'
  *   (0xffffffff) is added for the testing purpose. Also '*' instrunctions are
  *   the ones that are newly added to PA2.
@@ -125,6 +596,7 @@ static inline bool strmatch(char* const str, const char* expect)
  * | `sw`   | i-format  | 0x2b                    |
  * | `slt`  | r-format* | 0 + 0x2a                |
  * | `slti` | i-format* | 0x0a                    |
+ * | `lui`  | i-format* | 0x0f                    |
  * | `beq`  | i-format* | 0x04                    |
  * | `bne`  | i-format* | 0x05                    |
  * | `jr`   | r-format* | 0 + 0x08                |
@@ -136,7 +608,7 @@ static inline bool strmatch(char* const str, const char* expect)
  *   1 if successfully processed the instruction.
  *   0 if @instr is 'halt' or unknown instructions
  */
-static int process_instruction(unsigned int instr)
+static int process_instruction(struct machine* m, unsigned int instr)
 {
 	// MIPS R-format Instructions : opcode(6 bits) + rs(5 bits) + rt(5 bits) + rd(5 bits) + shamt(5 bits) + funct(6 bits)
 	// MIPS I-format Instructions : opcode(6 bits) + rs(5 bits) + rt(5 bits) + constant or address(16 bits)
@@ -177,35 +649,35 @@ static int process_instruction(unsigned int instr)
 		switch (funct)
 		{
 		case 0x20: // add
-			registers[rd] = registers[rs] + registers[rt];
+			m->registers[rd] = m->registers[rs] + m->registers[rt];
 			break;
 		case 0x22: // sub
-			registers[rd] = registers[rs] - registers[rt];
+			m->registers[rd] = m->registers[rs] - m->registers[rt];
 			break;
 		case 0x24: // and
-			registers[rd] = registers[rs] & registers[rt];
+			m->registers[rd] = m->registers[rs] & m->registers[rt];
 			break;
 		case 0x25: // or
-			registers[rd] = registers[rs] | registers[rt];
+			m->registers[rd] = m->registers[rs] | m->registers[rt];
 			break;
 		case 0x27: // nor
-			registers[rd] = ~(registers[rs] | registers[rt]);
+			m->registers[rd] = ~(m->registers[rs] | m->registers[rt]);
 			break;
 		case 0x00: // sll
-			registers[rd] = registers[rt] << shamt;
+			m->registers[rd] = m->registers[rt] << shamt;
 			break;
 		case 0x02: // srl
-			registers[rd] = registers[rt] >> shamt;
+			m->registers[rd] = m->registers[rt] >> shamt;
 			break;
 		case 0x03: // sra
-			registers[rd] = (signed)registers[rt] >> shamt; // signed shift
+			m->registers[rd] = (signed)m->registers[rt] >> shamt; // signed shift
 			break;
 		case 0x2a: // slt
-			if (pc == INITIAL_PC) registers[rd] = registers[rs] < registers[rt]; // basic
-			else registers[rd] = (char)registers[rs] < (char)registers[rt]; // run basic
+			if (m->pc == INITIAL_PC) m->registers[rd] = m->registers[rs] < m->registers[rt]; // basic
+			else m->registers[rd] = (char)m->registers[rs] < (char)m->registers[rt]; // run basic
 			break;
 		case 0x08: // jr
-			pc = registers[rs]; // rs Ͱ  ִ ּġ jump
+			m->pc = m->registers[rs]; // rs Ͱ  ִ ּġ jump
 		}
 	}
 	else if ((opcode == 0x02) || (opcode == 0x03)) { // J-format
@@ -214,11 +686,11 @@ static int process_instruction(unsigned int instr)
 		switch (opcode)
 		{
 		case 0x02: // j
-			pc = (pc >> 27 << 27) | (immedi << 2); // pc[31...28](4 bits) + immedi(26 bits) + 00(2 bits)
+			m->pc = (m->pc >> 27 << 27) | (immedi << 2); // pc[31...28](4 bits) + immedi(26 bits) + 00(2 bits)
 			break;
 		case 0x03: // jal
-			registers[31] = pc; // ra jal  instruction Ű Ѵ.
-			pc = (pc >> 27 << 27) | (immedi << 2); // pc[31...28](4 bits) + immedi(26 bits) + 00(2 bits)
+			m->registers[31] = m->pc; // ra jal  instruction Ű Ѵ.
+			m->pc = (m->pc >> 27 << 27) | (immedi << 2); // pc[31...28](4 bits) + immedi(26 bits) + 00(2 bits)
 		}
 	}
 	else { // I-format
@@ -230,34 +702,32 @@ static int process_instruction(unsigned int instr)
 		switch (opcode)
 		{
 		case 0x08: // addi
-			registers[rt] = registers[rs] + immedi;
+			m->registers[rt] = m->registers[rs] + immedi;
 			break;
 		case 0x0c: // andi
-			registers[rt] = registers[rs] & (unsigned short)immedi;
+			m->registers[rt] = m->registers[rs] & (unsigned short)immedi;
 			break;
 		case 0x0d: // ori
-			registers[rt] = registers[rs] | (unsigned short)immedi;
+			m->registers[rt] = m->registers[rs] | (unsigned short)immedi;
 			break;
 		case 0x23: // lw -> 1 word (32 bits) ´.
-			registers[rt] = (*(memory + registers[rs] + immedi) << 24)
-				| (*(memory + registers[rs] + immedi + 1) << 16)
-				| (*(memory + registers[rs] + immedi + 2) << 8)
-				| *(memory + registers[rs] + immedi + 3);
+			m->registers[rt] = load_word(&m->mem, m->registers[rs] + immedi);
 			break;
 		case 0x2b: // sw -> 1 word (32 bits) Ѵ.
-			*(memory + registers[rs] + immedi) = registers[rt] >> 24;
-			*(memory + registers[rs] + immedi + 1) = (registers[rt] >> 16) & 0xFF;
-			*(memory + registers[rs] + immedi + 2) = (registers[rt] >> 8) & 0xFF;
-			*(memory + registers[rs] + immedi + 3) = registers[rt] & 0xFF;
+			store_word(&m->mem, m->registers[rs] + immedi, m->registers[rt]);
+			invalidate_decoded(m->decoded, m->registers[rs] + immedi);
 			break;
 		case 0x0a: // slti
-			registers[rt] = registers[rs] < immedi;
+			m->registers[rt] = m->registers[rs] < immedi;
+			break;
+		case 0x0f: // lui
+			m->registers[rt] = immedi << 16;
 			break;
 		case 0x04: // beq
-			if (registers[rt] == registers[rs]) pc = pc + 4 * immedi; // ⼭ immedi offset
+			if (m->registers[rt] == m->registers[rs]) m->pc = m->pc + 4 * immedi; // ⼭ immedi offset
 			break;
 		case 0x05: // bne
-			if (registers[rt] != registers[rs]) pc = pc + 4 * immedi; // ⼭ immedi offset
+			if (m->registers[rt] != m->registers[rs]) m->pc = m->pc + 4 * immedi; // ⼭ immedi offset
 		}
 	}
 	return 1;
@@ -290,13 +760,120 @@ static int process_instruction(unsigned int instr)
  *
  *	 Refer to the @main() for reading data from files. (fopen, fgets, fclose).
  *
+ *	 A binary program image written by "pa1 -o" (see ../PA1/image.h) is
+ *	 loaded too. It is recognized by its header, and its payload is copied
+ *	 into the memory of @m as a whole.
+ *
  * RETURN
  *	 0 on successfully load the program
  *	 any other value otherwise
  */
 
-static int load_program(char* const filename)
+/**
+ * Map the whole file @filename read-only into memory, and put its size into
+ * @len. Returns NULL if the file cannot be opened or is empty.
+ */
+static unsigned char* map_file(const char* filename, size_t* len)
+{
+#ifdef _WIN32
+	FILE* file = fopen(filename, "rb");
+	unsigned char* data = NULL;
+	long size;
+
+	if (!file) return NULL;
+	if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0) {
+		data = malloc(size);
+		if (data && fread(data, 1, size, file) != (size_t)size) {
+			free(data);
+			data = NULL;
+		}
+		*len = size;
+	}
+	fclose(file);
+	return data;
+#else
+	struct stat st;
+	void* data = MAP_FAILED;
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0) return NULL;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		*len = st.st_size;
+	}
+	close(fd);
+	return data == MAP_FAILED ? NULL : data;
+#endif
+}
+
+static void unmap_file(unsigned char* data, size_t len)
+{
+#ifdef _WIN32
+	free(data);
+#else
+	munmap(data, len);
+#endif
+}
+
+/**
+ * Load @filename if it is a binary program image.
+ *
+ * RETURN
+ *	 0 if the image is loaded
+ *	 -ENOEXEC if @filename is not an image (or cannot be read at all)
+ *	 -EINVAL if the image is broken, does not fit in the address space, or
+ *	         starts somewhere other than in its payload or at the halt after it
+ */
+static int load_image(struct machine* m, const char* filename)
+{
+	struct image_header header;
+	size_t len;
+	unsigned char* data = map_file(filename, &len);
+	const unsigned char* payload;
+	int ret;
+
+	if (!data) return -ENOEXEC;
+	payload = data + IMAGE_HEADER_SIZE;
+
+	ret = image_read_header(data, len, &header);
+	if (ret == -ENOEXEC) goto out;
+
+	if (ret || header.length % 4 || header.load_addr % 4 ||
+		header.load_addr > UINT32_MAX - 3 ||
+		header.length > UINT32_MAX - 3 - header.load_addr ||
+		header.entry % 4 || header.entry < header.load_addr ||
+		header.entry - header.load_addr > header.length) {
+		fprintf(stderr, "Invalid program image %s\n", filename);
+		ret = -EINVAL;
+		goto out;
+	}
+	if (image_checksum(payload, header.length) != header.checksum) {
+		fprintf(stderr, "Checksum mismatch in program image %s\n", filename);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	write_memory(&m->mem, header.load_addr, payload, header.length);
+	store_word(&m->mem, header.load_addr + header.length, 0xffffffff); /* halt */
+	m->entry_pc = header.entry;
+
+out:
+	unmap_file(data, len);
+	return ret;
+}
+
+static int load_program(struct machine* m, char* const filename)
 {
+	int ret;
+
+	flush_decoded(m);
+	memset(m->fusion_counts, 0, sizeof(m->fusion_counts));
+	memset(m->fusion_sites, 0, sizeof(m->fusion_sites));
+
+	ret = load_image(m, filename);
+	if (ret != -ENOEXEC) return ret;
+	m->entry_pc = INITIAL_PC;
+
 	// ޸𸮿 instruction ־ . 迭  ĭ 8 Ʈ -> memory[] = 0x00
 	// fgets  ȿ ͸  پ о ޸𸮿 εѴ.
 
@@ -310,104 +887,2144 @@ static int load_program(char* const filename)
 		while (fgets(linebuffer, sizeof(linebuffer), input)) {
 			instr = strtoimax(linebuffer, NULL, 0);
 
-			*(memory + pc + 4 * memIndex) = instr >> 24;
-			*(memory + pc + 4 * memIndex + 1) = (instr >> 16) & 0xFF;
-			*(memory + pc + 4 * memIndex + 2) = (instr >> 8) & 0xFF;
-			*(memory + pc + 4 * memIndex + 3) = instr & 0xFF;
+			store_word(&m->mem, m->pc + 4 * memIndex, instr);
 			memIndex++;
 		}
 		// append 'halt' instruction
-		*(memory + pc + 4 * memIndex) = 0xFF;
-		*(memory + pc + 4 * memIndex + 1) = 0xFF;
-		*(memory + pc + 4 * memIndex + 2) = 0xFF;
-		*(memory + pc + 4 * memIndex + 3) = 0xFF;
+		store_word(&m->mem, m->pc + 4 * memIndex, 0xffffffff);
 
 		fclose(input);
 		return 0;
 	}
-	else printf("error!\n");
+	ret = -errno;
+	printf("error!\n");
 
-	return -EINVAL;
+	return ret;
 }
 
 
 /**********************************************************************
- * run_program
- *
- * DESCRIPTION
- *   Start running the program that is loaded by @load_program function above.
- *   If you implement @load_program() properly, the first instruction is placed
- *   at @INITIAL_PC. Using @pc, which is the program counter of this processor,
- *   you can emulate the MIPS processor by
+ * Snapshots
  *
- *   1. Read instruction from @pc
- *   2. Increment @pc by 4
- *   3. Call @process_instruction(instruction)
- *   4. Repeat until @process_instruction() returns 0
+ * take_snapshot() saves the registers, PCs, and memory of a machine into
+ * @s, and restore_snapshot() puts a machine back into that state. A
+ * snapshot does not copy any page. It shares the pages of the machine, and
+ * the machine copies a page only when it first stores to it afterwards.
  *
- * RETURN
- *   0
+ * restore_snapshot() hands the pages of @s back to the machine in place of
+ * the ones they differ from, which are the ones stored to or allocated since
+ * @s was taken. Only the slots of its @decoded on those pages are marked as
+ * undecoded again, so the rest of the program stays decoded. A snapshot can
+ * be restored any number of times, until drop_snapshot() releases it.
  */
-static int run_program(void)
-{
-	// ޸𸮿 ε instruction process_instruction(instr)  
-	pc = INITIAL_PC;
-	unsigned int instr;
-
-	while (true) {
-		instr = (memory[pc] << 24) | (memory[pc + 1] << 16) | (memory[pc + 2] << 8) | memory[pc + 3];
-		pc = pc + 4;
-		if (!process_instruction(instr)) return 0;
-	}
+struct snapshot {
+	unsigned int pc;
+	unsigned int entry_pc;
+	unsigned int registers[32];
+	struct page_table pages;
+};
 
-	return 0;
+static void take_snapshot(struct machine* m, struct snapshot* s)
+{
+	s->pc = m->pc;
+	s->entry_pc = m->entry_pc;
+	memcpy(s->registers, m->registers, sizeof(s->registers));
+	share_pages(&s->pages, &m->mem.page_table);
+	flush_tlb(&m->mem);
 }
 
+static void drop_snapshot(struct snapshot* s)
+{
+	free_pages(&s->pages);
+}
 
-/*====================================================================*/
-/*          ****** DO NOT MODIFY ANYTHING FROM THIS LINE ******       */
-static void __show_registers(char* const register_name)
+static void restore_snapshot(struct machine* m, const struct snapshot* s)
 {
-	int from = 0, to = 0;
-	bool include_pc = false;
+	struct page_table* page_table = &m->mem.page_table;
 
-	if (strmatch(register_name, "all")) {
-		from = 0;
-		to = 32;
-		include_pc = true;
-	}
-	else if (strmatch(register_name, "pc")) {
-		include_pc = true;
-	}
-	else {
-		for (int i = 0; i < sizeof(register_names) / sizeof(*register_names); i++) {
-			if (strmatch(register_name, register_names[i])) {
-				from = i;
-				to = i + 1;
-			}
+	m->pc = s->pc;
+	m->entry_pc = s->entry_pc;
+	memcpy(m->registers, s->registers, sizeof(m->registers));
+
+	for (size_t i = 0; i < NR_DIRS; i++) {
+		struct page** dir = page_table->dirs[i];
+		struct page* const* saved = s->pages.dirs[i];
+
+		if (!dir && !saved) continue;
+		if (!dir && !(dir = page_table->dirs[i] = calloc(NR_DIR_PAGES, sizeof(*dir)))) {
+			out_of_memory((unsigned int)(i * NR_DIR_PAGES) << PAGE_BITS);
 		}
-	}
+		for (size_t j = 0; j < NR_DIR_PAGES; j++) {
+			struct page* page = saved ? saved[j] : NULL;
+			unsigned int addr = (unsigned int)(i * NR_DIR_PAGES + j) << PAGE_BITS;
 
-	for (int i = from; i < to; i++) {
-		fprintf(stderr, "[%02d:%2s] 0x%08x    %u\n", i, register_names[i], registers[i], registers[i]);
-	}
-	if (include_pc) {
-		fprintf(stderr, "[  pc ] 0x%08x\n", pc);
+			if (dir[j] == page) continue;
+
+			page_table->nr_pages += !!page - !!dir[j];
+			put_page(dir[j]);
+			if (page) page->refs++;
+			dir[j] = page;
+
+			/* Fused slots up to two words before the page read from it */
+			if (addr < DECODED_BYTES) {
+				for (unsigned int k = addr / 4 >= 2 ? addr / 4 - 2 : 0; k < (addr + PAGE_BYTES) / 4; k++) {
+					m->decoded[k].op = OP_UNDECODED;
+				}
+			}
+		}
 	}
+	flush_tlb(&m->mem);
 }
 
-static void __dump_memory(unsigned int addr, size_t length)
-{
+
+/**
+ * Decode @instr into @d, with the same fields process_instruction() takes
+ * out of it.
+ */
+static void predecode(unsigned int instr, struct decoded* d)
+{
+	static const unsigned char r_format_ops[64] = {
+		[0x20] = OP_ADD, [0x22] = OP_SUB, [0x24] = OP_AND, [0x25] = OP_OR,
+		[0x27] = OP_NOR, [0x00] = OP_SLL, [0x02] = OP_SRL, [0x03] = OP_SRA,
+		[0x2a] = OP_SLT, [0x08] = OP_JR,
+	};
+	static const unsigned char opcode_ops[64] = {
+		[0x02] = OP_J, [0x03] = OP_JAL,
+		[0x08] = OP_ADDI, [0x0c] = OP_ANDI, [0x0d] = OP_ORI, [0x23] = OP_LW,
+		[0x2b] = OP_SW, [0x0a] = OP_SLTI, [0x0f] = OP_LUI, [0x04] = OP_BEQ,
+		[0x05] = OP_BNE,
+	};
+	unsigned int opcode = instr >> 26;
+
+	d->rs = (instr >> 21) & 0x1f;
+	d->rt = (instr >> 16) & 0x1f;
+	d->rd = (instr >> 11) & 0x1f;
+
+	if (instr == 0xffffffff) {
+		d->op = OP_HALT;
+	}
+	else if (opcode == 0) {
+		d->op = r_format_ops[instr & 0x3f] ? r_format_ops[instr & 0x3f] : OP_NOP;
+		d->imm = (instr >> 6) & 0x1f;
+	}
+	else {
+		d->op = opcode_ops[opcode] ? opcode_ops[opcode] : OP_NOP;
+		switch (d->op) {
+		case OP_J:
+		case OP_JAL:
+			d->imm = (instr & 0x3ffffff) << 2;
+			break;
+		case OP_ANDI:
+		case OP_ORI:
+			d->imm = instr & 0xffff;
+			break;
+		default:
+			d->imm = (unsigned int)(short)(instr & 0xffff);
+		}
+	}
+}
+
+/**
+ * Superinstructions
+ *
+ * When decode_slot() decodes the first instruction of one of the sequences
+ * in @fusions[], it puts the fused op of the whole sequence into the slot
+ * instead, and decodes the slots of the rest as usual. The fused op runs
+ * all of them in one go, reading the fields of the rest from their slots,
+ * and bumps @pc between them just as running them one by one would. So a
+ * branch into the middle of a sequence still finds the slots it needs.
+ *
+ * The registers the instructions use do not matter, only their ops, and
+ * none of the sequences stores before its end; running them in one go
+ * gives the same registers, memory, and @pc.
+ *
+ * The fused ops count how many times they run into @fusion_counts of the
+ * machine, which run_program() and run_threaded() zero when they start.
+ * When they halt, end_fused_run() counts the slots of each fused op into
+ * @fusion_sites, so the two describe the same run even after run_jit()
+ * or a load throws the decoded slots away.
+ */
+static const struct fusion {
+	const char* name;
+	unsigned char ops[3];	/* The sequence, up to three long */
+	unsigned char nr_ops;
+} fusions[NR_OPS - OP_FIRST_FUSED] = {
+	[OP_LW_ADDI - OP_FIRST_FUSED] = { "lw+addi", { OP_LW, OP_ADDI }, 2 },
+	[OP_SLT_BNE - OP_FIRST_FUSED] = { "slt+bne", { OP_SLT, OP_BNE }, 2 },
+	[OP_SLT_BEQ - OP_FIRST_FUSED] = { "slt+beq", { OP_SLT, OP_BEQ }, 2 },
+	[OP_SLL_ADD - OP_FIRST_FUSED] = { "sll+add", { OP_SLL, OP_ADD }, 2 },
+	[OP_SLL_ADD_LW - OP_FIRST_FUSED] = { "sll+add+lw", { OP_SLL, OP_ADD, OP_LW }, 3 },
+};
+
+#define NR_FUSIONS	(sizeof(fusions) / sizeof(*fusions))
+
+static void start_fused_run(struct machine* m)
+{
+	memset(m->fusion_counts, 0, sizeof(m->fusion_counts));
+}
+
+/* Count the slots of each fused op into @m->fusion_sites. Returns 0 for the engine to return */
+static int end_fused_run(struct machine* m)
+{
+	memset(m->fusion_sites, 0, sizeof(m->fusion_sites));
+	if (!m->fusion_enabled) return 0;
+
+	for (size_t i = m->decoded_first; i <= m->decoded_last; i++) {
+		if (m->decoded[i].op >= OP_FIRST_FUSED) m->fusion_sites[m->decoded[i].op - OP_FIRST_FUSED]++;
+	}
+	return 0;
+}
+
+/* Decode the slot of the aligned word at @addr, fusing it with the words after it if it can */
+static void decode_slot(struct machine* m, unsigned int addr)
+{
+	struct decoded* d = &m->decoded[addr / 4];
+	unsigned char ops[3];
+
+	if (addr / 4 < m->decoded_first) m->decoded_first = addr / 4;
+	if (addr / 4 > m->decoded_last) m->decoded_last = addr / 4;
+
+	predecode(load_word(&m->mem, addr), d);
+	if (!m->fusion_enabled) return;
+
+	ops[0] = d->op;
+	for (int i = 1; i < 3; i++) {
+		struct decoded next;
+
+		if (addr / 4 + i >= NR_DECODED) {
+			ops[i] = OP_UNDECODED;
+			continue;
+		}
+		predecode(load_word(&m->mem, addr + 4 * i), &next);
+		ops[i] = next.op;
+	}
+
+	/* Longer sequences come later in @fusions[], and win */
+	for (int f = NR_FUSIONS - 1; f >= 0; f--) {
+		if (memcmp(ops, fusions[f].ops, fusions[f].nr_ops)) continue;
+
+		for (int i = 1; i < fusions[f].nr_ops; i++) {
+			if (m->decoded[addr / 4 + i].op == OP_UNDECODED) decode_slot(m, addr + 4 * i);
+		}
+		d->op = OP_FIRST_FUSED + f;
+		return;
+	}
+}
+
+/**
+ * Run the instruction decoded into @d, exactly as process_instruction()
+ * runs its word. Returns 0 for 'halt', and 1 otherwise.
+ *
+ * @d has to be in the @decoded table of @m, where fused ops find the rest
+ * of their instructions.
+ */
+static inline int execute_decoded(struct machine* m, const struct decoded* d)
+{
+	unsigned int addr;
+
+	switch (d->op) {
+	case OP_HALT:
+		return 0;
+	case OP_ADD:
+		m->registers[d->rd] = m->registers[d->rs] + m->registers[d->rt];
+		break;
+	case OP_SUB:
+		m->registers[d->rd] = m->registers[d->rs] - m->registers[d->rt];
+		break;
+	case OP_AND:
+		m->registers[d->rd] = m->registers[d->rs] & m->registers[d->rt];
+		break;
+	case OP_OR:
+		m->registers[d->rd] = m->registers[d->rs] | m->registers[d->rt];
+		break;
+	case OP_NOR:
+		m->registers[d->rd] = ~(m->registers[d->rs] | m->registers[d->rt]);
+		break;
+	case OP_SLL:
+		m->registers[d->rd] = m->registers[d->rt] << d->imm;
+		break;
+	case OP_SRL:
+		m->registers[d->rd] = m->registers[d->rt] >> d->imm;
+		break;
+	case OP_SRA:
+		m->registers[d->rd] = (signed)m->registers[d->rt] >> d->imm;
+		break;
+	case OP_SLT:
+		if (m->pc == INITIAL_PC) m->registers[d->rd] = m->registers[d->rs] < m->registers[d->rt];
+		else m->registers[d->rd] = (char)m->registers[d->rs] < (char)m->registers[d->rt];
+		break;
+	case OP_JR:
+		m->pc = m->registers[d->rs];
+		break;
+	case OP_JAL:
+		m->registers[31] = m->pc;
+		/* Fall through */
+	case OP_J:
+		m->pc = (m->pc >> 27 << 27) | d->imm;
+		break;
+	case OP_ADDI:
+		m->registers[d->rt] = m->registers[d->rs] + d->imm;
+		break;
+	case OP_ANDI:
+		m->registers[d->rt] = m->registers[d->rs] & d->imm;
+		break;
+	case OP_ORI:
+		m->registers[d->rt] = m->registers[d->rs] | d->imm;
+		break;
+	case OP_LW:
+		addr = m->registers[d->rs] + d->imm;
+		m->registers[d->rt] = load_word(&m->mem, addr);
+		break;
+	case OP_SW:
+		addr = m->registers[d->rs] + d->imm;
+		store_word(&m->mem, addr, m->registers[d->rt]);
+		invalidate_decoded(m->decoded, addr);
+		break;
+	case OP_SLTI:
+		m->registers[d->rt] = m->registers[d->rs] < d->imm;
+		break;
+	case OP_LUI:
+		m->registers[d->rt] = d->imm << 16;
+		break;
+	case OP_BEQ:
+		if (m->registers[d->rt] == m->registers[d->rs]) m->pc = m->pc + 4 * d->imm;
+		break;
+	case OP_BNE:
+		if (m->registers[d->rt] != m->registers[d->rs]) m->pc = m->pc + 4 * d->imm;
+		break;
+	case OP_LW_ADDI:
+		m->fusion_counts[OP_LW_ADDI - OP_FIRST_FUSED]++;
+		m->registers[d->rt] = load_word(&m->mem, m->registers[d->rs] + d->imm);
+		m->pc = m->pc + 4;
+		m->registers[d[1].rt] = m->registers[d[1].rs] + d[1].imm;
+		break;
+	case OP_SLT_BNE:
+	case OP_SLT_BEQ:
+		m->fusion_counts[d->op - OP_FIRST_FUSED]++;
+		if (m->pc == INITIAL_PC) m->registers[d->rd] = m->registers[d->rs] < m->registers[d->rt];
+		else m->registers[d->rd] = (char)m->registers[d->rs] < (char)m->registers[d->rt];
+		m->pc = m->pc + 4;
+		if ((m->registers[d[1].rt] == m->registers[d[1].rs]) == (d->op == OP_SLT_BEQ)) m->pc = m->pc + 4 * d[1].imm;
+		break;
+	case OP_SLL_ADD:
+	case OP_SLL_ADD_LW:
+		m->fusion_counts[d->op - OP_FIRST_FUSED]++;
+		m->registers[d->rd] = m->registers[d->rt] << d->imm;
+		m->pc = m->pc + 4;
+		m->registers[d[1].rd] = m->registers[d[1].rs] + m->registers[d[1].rt];
+		if (d->op == OP_SLL_ADD_LW) {
+			m->pc = m->pc + 4;
+			m->registers[d[2].rt] = load_word(&m->mem, m->registers[d[2].rs] + d[2].imm);
+		}
+		break;
+	}
+	return 1;
+}
+
+
+/**********************************************************************
+ * run_profiled
+ *
+ * DESCRIPTION
+ *   Run the program loaded into @m from its entry point, exactly as the
+ *   other engines do, and count what it runs into @m->profile. The 'halt'
+ *   that stops the program is not counted. Unknown instructions run as
+ *   no-ops and are counted under their opcode or funct, which the report
+ *   shows as "unknown".
+ *
+ * RETURN
+ *   0
+ */
+static int run_profiled(struct machine* m)
+{
+	struct profile* p = m->profile;
+
+	reset_profile(p);
+
+	m->pc = m->entry_pc;
+	while (true) {
+		unsigned int addr = m->pc;
+		unsigned int instr = load_word(&m->mem, addr);
+		unsigned int opcode = instr >> 26;
+		unsigned int rs = m->registers[(instr >> 21) & 0x1f], rt = m->registers[(instr >> 16) & 0x1f];
+		struct profile_entry* e;
+
+		m->pc = addr + 4;
+		if (!process_instruction(m, instr)) return 0;
+
+		e = profile_entry(p, addr);
+		e->instr = instr;
+		e->count++;
+		p->classes[PROFILE_CLASS(instr)]++;
+		p->nr_instructions++;
+
+		if (opcode == 0x04 || opcode == 0x05) {
+			bool taken = (rs == rt) == (opcode == 0x04);
+
+			e->taken += taken;
+			p->branches++;
+			p->taken += taken;
+		}
+		else if (opcode == 0x23) {
+			p->loads++;
+		}
+		else if (opcode == 0x2b) {
+			p->stores++;
+		}
+	}
+}
+
+/**********************************************************************
+ * run_program
+ *
+ * DESCRIPTION
+ *   Start running the program that is loaded by @load_program function above.
+ *   If you implement @load_program() properly, the first instruction is placed
+ *   at @INITIAL_PC. Using @pc, which is the program counter of this processor,
+ *   you can emulate the MIPS processor by
+ *
+ *   1. Read instruction from @pc
+ *   2. Increment @pc by 4
+ *   3. Call @process_instruction(instruction)
+ *   4. Repeat until @process_instruction() returns 0
+ *
+ *   Each instruction is decoded once into @decoded[] (see above), and run
+ *   from there by execute_decoded() instead of process_instruction(). Some
+ *   sequences of instructions run as a single superinstruction.
+ *   Words that are not aligned or not covered by @decoded[] are still
+ *   fetched and run by process_instruction() each time.
+ *
+ *   While @m is being profiled, the program runs in run_profiled() instead.
+ *
+ * RETURN
+ *   0
+ */
+static int run_program(struct machine* m)
+{
+	// ޸𸮿 ε instruction process_instruction(m, instr)  
+	if (m->profile) return run_profiled(m);
+
+	m->pc = m->entry_pc;
+	unsigned int instr;
+
+	start_fused_run(m);
+	while (true) {
+		struct decoded* d;
+
+		if (m->pc % 4 || m->pc / 4 >= NR_DECODED) {
+			instr = load_word(&m->mem, m->pc);
+			m->pc = m->pc + 4;
+			if (!process_instruction(m, instr)) return end_fused_run(m);
+			continue;
+		}
+
+		d = &m->decoded[m->pc / 4];
+		if (d->op == OP_UNDECODED) decode_slot(m, m->pc);
+		m->pc = m->pc + 4;
+		if (!execute_decoded(m, d)) return end_fused_run(m);
+	}
+
+	return 0;
+}
+
+
+/**********************************************************************
+ * run_threaded
+ *
+ * DESCRIPTION
+ *   Run the loaded program as @run_program() does, from the same
+ *   @decoded[] table, but with threaded code. Instead of going back to a
+ *   single switch, every instruction jumps straight to the handler of the
+ *   next one through @handlers[]. So each handler has its own indirect
+ *   branch, which the CPU predicts from the instruction that came before.
+ *
+ *   It needs the labels-as-values extension of GCC and clang; other
+ *   compilers just get @run_program().
+ *
+ * RETURN
+ *   0
+ */
+#if defined(__GNUC__)
+/* Non-zero if @p is not the address of an aligned word covered by @decoded[] */
+#define OUT_OF_LINE(p)	((p) & (~(DECODED_BYTES - 1) | 3))
+
+static int run_threaded(struct machine* m)
+{
+	static void* const handlers[] = {
+		[OP_UNDECODED] = &&undecoded, [OP_HALT] = &&halt, [OP_NOP] = &&next,
+		[OP_ADD] = &&add, [OP_SUB] = &&sub, [OP_AND] = &&and, [OP_OR] = &&or, [OP_NOR] = &&nor,
+		[OP_SLL] = &&sll, [OP_SRL] = &&srl, [OP_SRA] = &&sra, [OP_SLT] = &&slt, [OP_JR] = &&jr,
+		[OP_J] = &&j, [OP_JAL] = &&jal,
+		[OP_ADDI] = &&addi, [OP_ANDI] = &&andi, [OP_ORI] = &&ori, [OP_LW] = &&lw, [OP_SW] = &&sw,
+		[OP_SLTI] = &&slti, [OP_LUI] = &&lui, [OP_BEQ] = &&beq, [OP_BNE] = &&bne,
+		[OP_LW_ADDI] = &&lw_addi, [OP_SLT_BNE] = &&slt_bne, [OP_SLT_BEQ] = &&slt_beq,
+		[OP_SLL_ADD] = &&sll_add, [OP_SLL_ADD_LW] = &&sll_add_lw,
+	};
+	unsigned int p = m->entry_pc;	/* m->pc, kept in a register until the program halts */
+	const struct decoded* d;
+	unsigned int addr;
+
+#define DISPATCH() do {						\
+		if (OUT_OF_LINE(p)) goto out_of_line;	\
+		d = &m->decoded[p / 4];				\
+		p += 4;								\
+		goto *handlers[d->op];				\
+	} while (0)
+
+	start_fused_run(m);
+	DISPATCH();
+
+undecoded:
+	decode_slot(m, p - 4);
+	goto *handlers[d->op];
+out_of_line:
+	addr = p;
+	m->pc = p + 4;
+	if (!process_instruction(m, load_word(&m->mem, addr))) {
+		return end_fused_run(m);
+	}
+	p = m->pc;
+	DISPATCH();
+halt:
+	m->pc = p;
+	return end_fused_run(m);
+next:
+	DISPATCH();
+add:
+	m->registers[d->rd] = m->registers[d->rs] + m->registers[d->rt];
+	DISPATCH();
+sub:
+	m->registers[d->rd] = m->registers[d->rs] - m->registers[d->rt];
+	DISPATCH();
+and:
+	m->registers[d->rd] = m->registers[d->rs] & m->registers[d->rt];
+	DISPATCH();
+or:
+	m->registers[d->rd] = m->registers[d->rs] | m->registers[d->rt];
+	DISPATCH();
+nor:
+	m->registers[d->rd] = ~(m->registers[d->rs] | m->registers[d->rt]);
+	DISPATCH();
+sll:
+	m->registers[d->rd] = m->registers[d->rt] << d->imm;
+	DISPATCH();
+srl:
+	m->registers[d->rd] = m->registers[d->rt] >> d->imm;
+	DISPATCH();
+sra:
+	m->registers[d->rd] = (signed)m->registers[d->rt] >> d->imm;
+	DISPATCH();
+slt:
+	if (p == INITIAL_PC) m->registers[d->rd] = m->registers[d->rs] < m->registers[d->rt];
+	else m->registers[d->rd] = (char)m->registers[d->rs] < (char)m->registers[d->rt];
+	DISPATCH();
+jr:
+	p = m->registers[d->rs];
+	DISPATCH();
+jal:
+	m->registers[31] = p;
+j:
+	p = (p >> 27 << 27) | d->imm;
+	DISPATCH();
+addi:
+	m->registers[d->rt] = m->registers[d->rs] + d->imm;
+	DISPATCH();
+andi:
+	m->registers[d->rt] = m->registers[d->rs] & d->imm;
+	DISPATCH();
+ori:
+	m->registers[d->rt] = m->registers[d->rs] | d->imm;
+	DISPATCH();
+lw:
+	addr = m->registers[d->rs] + d->imm;
+	m->registers[d->rt] = load_word(&m->mem, addr);
+	DISPATCH();
+sw:
+	addr = m->registers[d->rs] + d->imm;
+	store_word(&m->mem, addr, m->registers[d->rt]);
+	invalidate_decoded(m->decoded, addr);
+	DISPATCH();
+slti:
+	m->registers[d->rt] = m->registers[d->rs] < d->imm;
+	DISPATCH();
+lui:
+	m->registers[d->rt] = d->imm << 16;
+	DISPATCH();
+beq:
+	if (m->registers[d->rt] == m->registers[d->rs]) p = p + 4 * d->imm;
+	DISPATCH();
+bne:
+	if (m->registers[d->rt] != m->registers[d->rs]) p = p + 4 * d->imm;
+	DISPATCH();
+lw_addi:
+	m->fusion_counts[OP_LW_ADDI - OP_FIRST_FUSED]++;
+	m->registers[d->rt] = load_word(&m->mem, m->registers[d->rs] + d->imm);
+	p += 4;
+	m->registers[d[1].rt] = m->registers[d[1].rs] + d[1].imm;
+	DISPATCH();
+slt_bne:
+	m->fusion_counts[OP_SLT_BNE - OP_FIRST_FUSED]++;
+	if (p == INITIAL_PC) m->registers[d->rd] = m->registers[d->rs] < m->registers[d->rt];
+	else m->registers[d->rd] = (char)m->registers[d->rs] < (char)m->registers[d->rt];
+	p += 4;
+	if (m->registers[d[1].rt] != m->registers[d[1].rs]) p = p + 4 * d[1].imm;
+	DISPATCH();
+slt_beq:
+	m->fusion_counts[OP_SLT_BEQ - OP_FIRST_FUSED]++;
+	if (p == INITIAL_PC) m->registers[d->rd] = m->registers[d->rs] < m->registers[d->rt];
+	else m->registers[d->rd] = (char)m->registers[d->rs] < (char)m->registers[d->rt];
+	p += 4;
+	if (m->registers[d[1].rt] == m->registers[d[1].rs]) p = p + 4 * d[1].imm;
+	DISPATCH();
+sll_add:
+	m->fusion_counts[OP_SLL_ADD - OP_FIRST_FUSED]++;
+	m->registers[d->rd] = m->registers[d->rt] << d->imm;
+	p += 4;
+	m->registers[d[1].rd] = m->registers[d[1].rs] + m->registers[d[1].rt];
+	DISPATCH();
+sll_add_lw:
+	m->fusion_counts[OP_SLL_ADD_LW - OP_FIRST_FUSED]++;
+	m->registers[d->rd] = m->registers[d->rt] << d->imm;
+	p += 4;
+	m->registers[d[1].rd] = m->registers[d[1].rs] + m->registers[d[1].rt];
+	p += 4;
+	m->registers[d[2].rt] = load_word(&m->mem, m->registers[d[2].rs] + d[2].imm);
+	DISPATCH();
+
+#undef DISPATCH
+}
+#else
+static int run_threaded(struct machine* m)
+{
+	return run_program(m);
+}
+#endif
+
+
+/**********************************************************************
+ * run_jit
+ *
+ * DESCRIPTION
+ *   Run the program loaded into @m as x86-64 code. Starting from its entry
+ *   point, each basic block is translated the first time the program gets
+ *   to it, into a function in @jit_code. Translated code keeps the
+ *   registers of @m in rbx and reads and writes them in place. lw and sw
+ *   look their word up in the TLB of @m, which is kept in r12, and call
+ *   load_word() or store_word() on a miss.
+ *
+ *   A block returns to run_jit() with the PC to go on from. When it ends in
+ *   a jump or branch whose target is known, the return also points at the
+ *   jmp that left the block. Once the target has been translated too, that
+ *   jmp is patched to go straight there, so hot loops stay in translated
+ *   code. jr and the rare cases below always return to run_jit().
+ *
+ *   @jit_covered[] counts the blocks each word was translated into. A store
+ *   to a counted word leaves the block right after the store, and only the
+ *   blocks that cover the word are thrown away, to be made again from the
+ *   new words when the program gets to them. As a block is at most
+ *   JIT_MAX_BLOCK words long, those are found among the blocks starting at
+ *   most that far before the word. The code of a block thrown away stays
+ *   where it is, with its start turned into a return to run_jit(), as other
+ *   blocks may jump there. A word rewritten JIT_MAX_REWRITES times is left
+ *   out of the blocks from then on, so that code patching itself in a loop
+ *   runs with process_instruction() instead of being translated over and
+ *   over. All translations are thrown away when @jit_code fills up.
+ *
+ *   Words that are not translated, 'halt' to begin with, and PCs that are
+ *   not aligned or not covered by @decoded[], are run with
+ *   process_instruction().
+ *
+ *   There is a single @jit_code, which is translated for one machine at a
+ *   time, so run_jit() must not run on more than one thread at once.
+ *
+ *   Elsewhere than x86-64 Linux and macOS, or when no executable memory
+ *   can be mapped, it is the same as @run_threaded().
+ *
+ * RETURN
+ *   0
+ */
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(_WIN32)
+#define JIT_CODE_SIZE		(16 << 20)
+#define JIT_MAX_BLOCK		64	/* Most instructions in a block */
+#define JIT_MAX_INSN_CODE	192	/* Most bytes of x86-64 code for one of them */
+
+#define JIT_MAX_REWRITES	4	/* Stores to a translated word before it is interpreted */
+
+/* What a block returns in rax and rdx */
+struct jit_exit {
+	unsigned long long pc;	/* With the address stored to in the upper half on JIT_STORE */
+	unsigned char* site;	/* The jmp to patch, NULL, or JIT_STORE */
+};
+
+#define JIT_STORE	((unsigned char*)1)	/* A store changed translated code */
+
+typedef struct jit_exit (*jit_entry_fn)(unsigned char* block);
+
+static unsigned char* jit_code;		/* Entry and exit stubs, and then the blocks */
+static size_t jit_len;
+static size_t jit_stubs_len;
+static unsigned char* jit_exit_stub;
+static unsigned char* jit_stale_stub;			/* Where the blocks thrown away return through */
+static unsigned char* jit_blocks[NR_DECODED];	/* Translation of the block at each word */
+static unsigned char jit_block_words[NR_DECODED];	/* Words the block at each word covers */
+static unsigned char jit_covered[NR_DECODED];	/* Blocks each word is translated into */
+static unsigned char jit_rewrites[NR_DECODED];	/* Stores each translated word got, up to JIT_MAX_REWRITES */
+static unsigned int jit_generation;				/* Bumped whenever translations are thrown away */
+static struct machine* jit_machine;				/* The machine the stubs and blocks are for */
+
+enum { EAX = 0, ECX = 1, EDX = 2, ESI = 6 };
+
+/* The TLB lookup below knows the layout of @tlb */
+_Static_assert(sizeof(struct tlb_entry) == 16 && offsetof(struct tlb_entry, write_tag) == 4 &&
+	offsetof(struct tlb_entry, addend) == 8, "tlb_entry layout");
+
+static inline void emit8(unsigned int byte)
+{
+	jit_code[jit_len++] = (unsigned char)byte;
+}
+
+static inline void emit32(unsigned int value)
+{
+	memcpy(jit_code + jit_len, &value, 4);
+	jit_len += 4;
+}
+
+static inline void emit64(unsigned long long value)
+{
+	memcpy(jit_code + jit_len, &value, 8);
+	jit_len += 8;
+}
+
+/* @opcode with @reg and registers[@guest] as operands, that is [rbx + 4 * @guest] */
+static inline void emit_guest(unsigned int opcode, int reg, unsigned int guest)
+{
+	emit8(opcode);
+	emit8(0x43 | reg << 3);
+	emit8(4 * guest);
+}
+
+/* Emit a jmp or jcc opcode, and return where its rel32 goes */
+static inline size_t emit_jump(unsigned int opcode)
+{
+	if (opcode > 0xff) emit8(opcode >> 8);
+	emit8(opcode & 0xff);
+	emit32(0);
+	return jit_len - 4;
+}
+
+static inline void patch_jump(size_t rel, const unsigned char* target)
+{
+	int offset = (int)(target - (jit_code + rel + 4));
+
+	memcpy(jit_code + rel, &offset, 4);
+}
+
+/* Return @pc to run_jit(), with the jmp to patch if @chain */
+static void emit_exit(unsigned int pc, bool chain)
+{
+	emit8(0xb8);	/* mov eax, pc */
+	emit32(pc);
+	if (chain) {
+		emit8(0x48);	/* lea rdx, [rip] */
+		emit8(0x8d);
+		emit8(0x15);
+		emit32(0);
+	}
+	else {
+		emit8(0x31);	/* xor edx, edx */
+		emit8(0xd2);
+	}
+	patch_jump(emit_jump(0xe9), jit_exit_stub);
+}
+
+/* Leave the block after a store at @addr if the store hit translated code */
+static void emit_store_check(unsigned int next_pc)
+{
+	size_t hits[2], over;
+
+	for (int i = 0; i < 2; i++) {
+		if (i == 0) {
+			emit8(0x89);	/* mov edx, ecx */
+			emit8(0xca);
+		}
+		else {
+			emit8(0x8d);	/* lea edx, [rcx + 3] */
+			emit8(0x51);
+			emit8(0x03);
+		}
+		emit8(0xc1);	/* shr edx, 2 */
+		emit8(0xea);
+		emit8(0x02);
+		emit8(0x81);	/* cmp edx, NR_DECODED */
+		emit8(0xfa);
+		emit32(NR_DECODED);
+		emit8(0x73);	/* jae over the next two */
+		emit8(12);
+		emit8(0x41);	/* cmp byte [r13 + rdx], 0 */
+		emit8(0x80);
+		emit8(0x7c);
+		emit8(0x15);
+		emit8(0x00);
+		emit8(0x00);
+		hits[i] = emit_jump(0x0f85);	/* jne */
+	}
+	over = emit_jump(0xe9);
+
+	patch_jump(hits[0], jit_code + jit_len);
+	patch_jump(hits[1], jit_code + jit_len);
+	emit8(0x89);	/* mov eax, ecx */
+	emit8(0xc8);
+	emit8(0x48);	/* shl rax, 32 */
+	emit8(0xc1);
+	emit8(0xe0);
+	emit8(0x20);
+	emit8(0xba);	/* mov edx, next_pc */
+	emit32(next_pc);
+	emit8(0x48);	/* or rax, rdx */
+	emit8(0x09);
+	emit8(0xd0);
+	emit8(0xba);	/* mov edx, JIT_STORE */
+	emit32(1);
+	patch_jump(emit_jump(0xe9), jit_exit_stub);
+
+	patch_jump(over, jit_code + jit_len);
+}
+
+/* ecx = registers[rs] + imm, the address lw and sw access */
+static void emit_address(const struct decoded* d)
+{
+	emit_guest(0x8b, ECX, d->rs);	/* mov ecx, [rs] */
+	emit8(0x81);					/* add ecx, imm */
+	emit8(0xc1);
+	emit32(d->imm);
+}
+
+/**
+ * Look the word at the address in ecx up in @tlb, to store to it if
+ * @write. On a hit, the word is at [rax + rdx]. It jumps to the rel32 it
+ * returns on a miss.
+ */
+static size_t emit_tlb_lookup(bool write)
+{
+	size_t miss;
+
+	emit8(0x89);	/* mov eax, ecx */
+	emit8(0xc8);
+	emit8(0x25);	/* and eax, ~(PAGE_BYTES - 1) | 3 */
+	emit32(~(PAGE_BYTES - 1) | 3);
+	emit8(0x89);	/* mov edx, ecx */
+	emit8(0xca);
+	emit8(0xc1);	/* shr edx, PAGE_BITS */
+	emit8(0xea);
+	emit8(PAGE_BITS);
+	emit8(0x83);	/* and edx, NR_TLB - 1 */
+	emit8(0xe2);
+	emit8(NR_TLB - 1);
+	emit8(0xc1);	/* shl edx, 4 */
+	emit8(0xe2);
+	emit8(0x04);
+	emit8(0x41);	/* cmp eax, [r12 + rdx + 4 * write] */
+	emit8(0x3b);
+	emit8(0x44);
+	emit8(0x14);
+	emit8(write ? 4 : 0);
+	miss = emit_jump(0x0f85);	/* jne */
+	emit8(0x49);	/* mov rax, [r12 + rdx + 8] */
+	emit8(0x8b);
+	emit8(0x44);
+	emit8(0x14);
+	emit8(0x08);
+	emit8(0x89);	/* mov edx, ecx */
+	emit8(0xca);
+	return miss;
+}
+
+/* call @fn, with the memory of @jit_machine and the address in ecx as its first arguments */
+static void emit_call(const void* fn)
+{
+	emit8(0x48);	/* mov rdi, &jit_machine->mem */
+	emit8(0xbf);
+	emit64((unsigned long long)(uintptr_t)&jit_machine->mem);
+	emit8(0x89);	/* mov esi, ecx */
+	emit8(0xce);
+	emit8(0x48);	/* mov rax, fn */
+	emit8(0xb8);
+	emit64((unsigned long long)(uintptr_t)fn);
+	emit8(0xff);	/* call rax */
+	emit8(0xd0);
+}
+
+/* registers[rd] = 0 or 1 from the flags, with setcc @setcc */
+static void emit_set(unsigned int setcc, unsigned int rd)
+{
+	emit8(0x0f);	/* setcc al */
+	emit8(setcc);
+	emit8(0xc0);
+	emit8(0x0f);	/* movzx eax, al */
+	emit8(0xb6);
+	emit8(0xc0);
+	emit_guest(0x89, EAX, rd);
+}
+
+static void jit_flush(void)
+{
+	jit_len = jit_stubs_len;
+	memset(jit_blocks, 0, sizeof(jit_blocks));
+	memset(jit_covered, 0, sizeof(jit_covered));
+	jit_generation++;
+}
+
+/**
+ * Throw away the blocks translated from the word at @addr. The start of
+ * each is overwritten with 'mov eax, start; jmp jit_stale_stub', which
+ * fits in the shortest block there is, a lone jr.
+ */
+static void jit_invalidate(unsigned int addr)
+{
+	unsigned int word = addr / 4;
+	unsigned int first = word >= JIT_MAX_BLOCK - 1 ? word - (JIT_MAX_BLOCK - 1) : 0;
+	size_t len = jit_len;
+
+	if (word >= NR_DECODED || !jit_covered[word]) return;
+
+	for (unsigned int start = first; start <= word; start++) {
+		unsigned char* block = jit_blocks[start];
+
+		if (!block || start + jit_block_words[start] <= word) continue;
+
+		jit_len = block - jit_code;
+		emit8(0xb8);	/* mov eax, start */
+		emit32(start * 4);
+		patch_jump(emit_jump(0xe9), jit_stale_stub);
+
+		for (unsigned int i = start; i < start + jit_block_words[start]; i++) {
+			jit_covered[i]--;
+		}
+		jit_blocks[start] = NULL;
+	}
+	jit_len = len;
+
+	if (jit_rewrites[word] < JIT_MAX_REWRITES) jit_rewrites[word]++;
+}
+
+/**
+ * Map @jit_code, and put the stubs for @m at its start unless they are
+ * there already. Returns false if it cannot be mapped.
+ */
+static bool jit_init(struct machine* m)
+{
+	if (!jit_code) {
+		void* code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (code == MAP_FAILED) return false;
+		jit_code = code;
+	}
+	if (jit_machine == m) return true;
+
+	jit_machine = m;
+	jit_len = 0;
+
+	/* Entry: save what the blocks use, load their bases, and go to the block in rdi */
+	emit8(0x53);			/* push rbx */
+	emit8(0x41);			/* push r12 */
+	emit8(0x54);
+	emit8(0x41);			/* push r13 */
+	emit8(0x55);
+	emit8(0x48);			/* mov rbx, m->registers */
+	emit8(0xbb);
+	emit64((unsigned long long)(uintptr_t)m->registers);
+	emit8(0x49);			/* mov r12, m->mem.tlb */
+	emit8(0xbc);
+	emit64((unsigned long long)(uintptr_t)m->mem.tlb);
+	emit8(0x49);			/* mov r13, jit_covered */
+	emit8(0xbd);
+	emit64((unsigned long long)(uintptr_t)jit_covered);
+	emit8(0xff);			/* jmp rdi */
+	emit8(0xe7);
+
+	jit_stale_stub = jit_code + jit_len;
+	emit8(0x31);			/* xor edx, edx, and on to the exit */
+	emit8(0xd2);
+
+	jit_exit_stub = jit_code + jit_len;
+	emit8(0x41);			/* pop r13 */
+	emit8(0x5d);
+	emit8(0x41);			/* pop r12 */
+	emit8(0x5c);
+	emit8(0x5b);			/* pop rbx */
+	emit8(0xc3);			/* ret */
+
+	jit_stubs_len = jit_len;
+	return true;
+}
+
+/**
+ * Translate the basic block at @start. Returns NULL if its first word is
+ * not translated.
+ */
+static unsigned char* jit_compile(unsigned int start)
+{
+	static const unsigned char alu_opcodes[] = {
+		[OP_ADD] = 0x03, [OP_SUB] = 0x2b, [OP_AND] = 0x23, [OP_OR] = 0x0b, [OP_NOR] = 0x0b,
+	};
+	static const unsigned char shift_modrms[] = {
+		[OP_SLL] = 0xe0, [OP_SRL] = 0xe8, [OP_SRA] = 0xf8,
+	};
+	static const unsigned char imm_opcodes[] = {
+		[OP_ADDI] = 0x05, [OP_ANDI] = 0x25, [OP_ORI] = 0x0d,
+	};
+	unsigned char* block;
+	unsigned int addr = start, words = 0;
+
+	if (jit_len + (JIT_MAX_BLOCK + 1) * JIT_MAX_INSN_CODE > JIT_CODE_SIZE) jit_flush();
+	block = jit_code + jit_len;
+
+	for (int nr = 0; ; nr++) {
+		unsigned int next = addr + 4;
+		struct decoded d;
+		size_t rel, miss;
+
+		if (addr / 4 >= NR_DECODED || nr == JIT_MAX_BLOCK) {
+			emit_exit(addr, true);
+			break;
+		}
+
+		predecode(load_word(&jit_machine->mem, addr), &d);
+		if (d.op == OP_HALT || jit_rewrites[addr / 4] == JIT_MAX_REWRITES) {
+			if (nr == 0) return NULL;
+			emit_exit(addr, true);
+			break;
+		}
+		jit_covered[addr / 4]++;
+		words++;
+
+		switch (d.op) {
+		case OP_NOP:
+			break;
+		case OP_ADD:
+		case OP_SUB:
+		case OP_AND:
+		case OP_OR:
+		case OP_NOR:
+			emit_guest(0x8b, EAX, d.rs);					/* mov eax, [rs] */
+			emit_guest(alu_opcodes[d.op], EAX, d.rt);		/* op eax, [rt] */
+			if (d.op == OP_NOR) {
+				emit8(0xf7);								/* not eax */
+				emit8(0xd0);
+			}
+			emit_guest(0x89, EAX, d.rd);					/* mov [rd], eax */
+			break;
+		case OP_SLL:
+		case OP_SRL:
+		case OP_SRA:
+			emit_guest(0x8b, EAX, d.rt);					/* mov eax, [rt] */
+			emit8(0xc1);									/* shift eax, shamt */
+			emit8(shift_modrms[d.op]);
+			emit8(d.imm);
+			emit_guest(0x89, EAX, d.rd);
+			break;
+		case OP_SLT:
+			if (next == INITIAL_PC) {
+				emit_guest(0x8b, EAX, d.rs);				/* mov eax, [rs] */
+				emit_guest(0x3b, EAX, d.rt);				/* cmp eax, [rt] */
+				emit_set(0x92, d.rd);						/* setb */
+			}
+			else {
+				emit8(0x0f);								/* movsx eax, byte [rs] */
+				emit_guest(0xbe, EAX, d.rs);
+				emit8(0x0f);								/* movsx ecx, byte [rt] */
+				emit_guest(0xbe, ECX, d.rt);
+				emit8(0x39);								/* cmp eax, ecx */
+				emit8(0xc8);
+				emit_set(0x9c, d.rd);						/* setl */
+			}
+			break;
+		case OP_ADDI:
+		case OP_ANDI:
+		case OP_ORI:
+			emit_guest(0x8b, EAX, d.rs);					/* mov eax, [rs] */
+			emit8(imm_opcodes[d.op]);						/* op eax, imm */
+			emit32(d.imm);
+			emit_guest(0x89, EAX, d.rt);					/* mov [rt], eax */
+			break;
+		case OP_SLTI:
+			emit_guest(0x8b, EAX, d.rs);					/* mov eax, [rs] */
+			emit8(0x3d);									/* cmp eax, imm */
+			emit32(d.imm);
+			emit_set(0x92, d.rt);							/* setb */
+			break;
+		case OP_LUI:
+			emit_guest(0xc7, EAX, d.rt);					/* mov dword [rt], imm << 16 */
+			emit32(d.imm << 16);
+			break;
+		case OP_LW:
+			emit_address(&d);
+			miss = emit_tlb_lookup(false);
+			emit8(0x8b);									/* mov eax, [rax + rdx] */
+			emit8(0x04);
+			emit8(0x10);
+			emit8(0x0f);									/* bswap eax */
+			emit8(0xc8);
+			rel = emit_jump(0xe9);							/* jmp over the miss */
+			patch_jump(miss, jit_code + jit_len);
+			emit_call(load_word);							/* eax = load_word(mem, ecx) */
+			patch_jump(rel, jit_code + jit_len);
+			emit_guest(0x89, EAX, d.rt);					/* mov [rt], eax */
+			break;
+		case OP_SW:
+			emit_address(&d);
+			miss = emit_tlb_lookup(true);
+			emit_guest(0x8b, ESI, d.rt);					/* mov esi, [rt] */
+			emit8(0x0f);									/* bswap esi */
+			emit8(0xce);
+			emit8(0x89);									/* mov [rax + rdx], esi */
+			emit8(0x34);
+			emit8(0x10);
+			rel = emit_jump(0xe9);							/* jmp over the miss */
+			patch_jump(miss, jit_code + jit_len);
+			emit_guest(0x8b, EDX, d.rt);					/* mov edx, [rt] */
+			emit_call(store_word);							/* store_word(mem, ecx, edx) */
+			emit_address(&d);								/* which took ecx */
+			patch_jump(rel, jit_code + jit_len);
+			emit_store_check(next);
+			break;
+		case OP_JR:
+			emit_guest(0x8b, EAX, d.rs);					/* mov eax, [rs] */
+			emit8(0x31);									/* xor edx, edx */
+			emit8(0xd2);
+			patch_jump(emit_jump(0xe9), jit_exit_stub);
+			goto out;
+		case OP_JAL:
+			emit_guest(0xc7, EAX, 31);						/* mov dword [ra], next */
+			emit32(next);
+			/* Fall through */
+		case OP_J:
+			emit_exit((next >> 27 << 27) | d.imm, true);
+			goto out;
+		case OP_BEQ:
+		case OP_BNE:
+			emit_guest(0x8b, EAX, d.rs);					/* mov eax, [rs] */
+			emit_guest(0x3b, EAX, d.rt);					/* cmp eax, [rt] */
+			rel = emit_jump(d.op == OP_BEQ ? 0x0f85 : 0x0f84);	/* jne / je to not taken */
+			emit_exit(next + 4 * d.imm, true);
+			patch_jump(rel, jit_code + jit_len);
+			emit_exit(next, true);
+			goto out;
+		}
+		addr = next;
+	}
+out:
+	jit_blocks[start / 4] = block;
+	jit_block_words[start / 4] = words;
+	return block;
+}
+
+static inline unsigned char* jit_lookup(unsigned int addr)
+{
+	return jit_blocks[addr / 4] ? jit_blocks[addr / 4] : jit_compile(addr);
+}
+
+/* Throw away the blocks a store to @addr changes, which spans two words unless aligned */
+static inline void jit_store(unsigned int addr)
+{
+	jit_invalidate(addr);
+	if (addr % 4) jit_invalidate(addr + 3);
+}
+
+static int run_jit(struct machine* m)
+{
+	if (!jit_init(m)) return run_threaded(m);
+	jit_flush();
+	memset(jit_rewrites, 0, sizeof(jit_rewrites));
+
+	m->pc = m->entry_pc;
+	while (true) {
+		unsigned char* block = OUT_OF_LINE(m->pc) ? NULL : jit_lookup(m->pc);
+		struct jit_exit exit;
+
+		if (!block) {
+			unsigned int instr = load_word(&m->mem, m->pc);
+			unsigned int addr = m->registers[(instr >> 21) & 0x1f] + (short)(instr & 0xffff);
+
+			m->pc = m->pc + 4;
+			if (!process_instruction(m, instr)) break;
+			if (instr >> 26 == 0x2b) jit_store(addr);
+			continue;
+		}
+
+		exit = ((jit_entry_fn)(void*)jit_code)(block);
+		m->pc = (unsigned int)exit.pc;
+
+		if (exit.site == JIT_STORE) {
+			jit_store((unsigned int)(exit.pc >> 32));
+		}
+		else if (exit.site && !OUT_OF_LINE(m->pc)) {
+			unsigned int generation = jit_generation;
+			unsigned char* target = jit_lookup(m->pc);
+
+			/* The exit is gone if translating the target threw everything away */
+			if (target && generation == jit_generation) patch_jump(exit.site + 1 - jit_code, target);
+		}
+	}
+
+	/* Stores from translated code leave @decoded behind */
+	flush_decoded(m);
+	return 0;
+}
+#else
+static int run_jit(struct machine* m)
+{
+	return run_threaded(m);
+}
+#endif
+
+
+/**********************************************************************
+ * Batch runner
+ *
+ * 'batch' runs every job of a job file on a machine of its own, with a
+ * pool of threads taking the jobs in turn. A job is a line of the file
+ * that names a program, and optionally the registers to set before it
+ * is loaded;
+ *
+ *   loop.bin  a0=10 a1=0x20
+ *
+ * Blank lines and lines starting with '#' are skipped. Jobs run with
+ * run_threaded(), as the JIT translates for one machine at a time.
+ *
+ * Each thread sets one machine up and runs all the jobs it takes on it,
+ * putting it back to a snapshot of it with nothing loaded before each
+ * job. That frees the pages the last job wrote, and a job costs about what
+ * its program does rather than a fresh @decoded table to clear and scan.
+ */
+struct batch_job {
+	char program[MAX_COMMAND];
+	unsigned int initial[32];	/* Registers when the program is loaded */
+	int ret;					/* 0, or the negative errno load_program() or machine_init() returned */
+	unsigned int pc;
+	unsigned int registers[32];	/* Registers when the program halted */
+};
+
+struct batch {
+	struct batch_job* jobs;
+	size_t nr_jobs;
+	size_t next;				/* The job the next free thread takes */
+#ifndef _WIN32
+	pthread_mutex_t lock;
+#endif
+};
+
+/**
+ * Parse a @line of a job file into @job.
+ *
+ * RETURN VALUE
+ *   0 if @line is a job
+ *   1 if it is blank or a comment
+ *   -EINVAL if it sets a register that does not exist or zr, or is too long
+ */
+static int parse_batch_job(char* line, struct batch_job* job)
+{
+	char* tokens[MAX_NR_TOKENS];
+	int nr_tokens = 0;
+
+	for (char* p = line; *p && nr_tokens < MAX_NR_TOKENS; ) {
+		while (isspace((unsigned char)*p)) *p++ = '\0';
+		if (!*p) break;
+		tokens[nr_tokens++] = p;
+		while (*p && !isspace((unsigned char)*p)) p++;
+	}
+	if (nr_tokens == 0 || tokens[0][0] == '#') return 1;
+	if (strlen(tokens[0]) >= sizeof(job->program)) return -EINVAL;
+
+	strcpy(job->program, tokens[0]);
+	memcpy(job->initial, boot_registers, sizeof(job->initial));
+
+	for (int i = 1; i < nr_tokens; i++) {
+		char* value = strchr(tokens[i], '=');
+		char* end;
+		int reg;
+
+		if (tokens[i][0] == '#') break;
+		if (!value) return -EINVAL;
+		*value++ = '\0';
+
+		for (char* p = tokens[i]; *p; p++) *p = tolower((unsigned char)*p);
+		for (reg = 0; reg < 32; reg++) {
+			if (strmatch(tokens[i], register_names[reg])) break;
+		}
+		if (reg == 32 || reg == 0) return -EINVAL;
+
+		job->initial[reg] = (unsigned int)strtoimax(value, &end, 0);
+		if (end == value || *end) return -EINVAL;
+	}
+	return 0;
+}
+
+/**
+ * Read the jobs of @filename into @batch. Lines that cannot be parsed are
+ * reported and skipped.
+ *
+ * RETURN VALUE
+ *   0 on success, or -errno if the file cannot be read or -ENOMEM
+ */
+static int load_batch(struct batch* batch, const char* filename)
+{
+	char line[MAX_COMMAND * 2];
+	size_t capacity = 0, nr_lines = 0;
+	FILE* input = fopen(filename, "r");
+
+	memset(batch, 0, sizeof(*batch));
+	if (!input) return -errno;
+
+	while (fgets(line, sizeof(line), input)) {
+		int ret;
+
+		nr_lines++;
+		if (batch->nr_jobs == capacity) {
+			size_t n = capacity ? capacity * 2 : 16;
+			struct batch_job* jobs = realloc(batch->jobs, n * sizeof(*jobs));
+
+			if (!jobs) {
+				fclose(input);
+				return -ENOMEM;
+			}
+			batch->jobs = jobs;
+			capacity = n;
+		}
+
+		ret = parse_batch_job(line, &batch->jobs[batch->nr_jobs]);
+		if (ret < 0) fprintf(stderr, "%s:%zu: invalid job\n", filename, nr_lines);
+		if (ret == 0) batch->nr_jobs++;
+	}
+	fclose(input);
+
+	return 0;
+}
+
+static void release_batch(struct batch* batch)
+{
+	free(batch->jobs);
+	batch->jobs = NULL;
+	batch->nr_jobs = 0;
+}
+
+/* Run @job on @m, which is put back to @empty first */
+static void run_batch_job(struct machine* m, const struct snapshot* empty, struct batch_job* job)
+{
+	restore_snapshot(m, empty);
+	memcpy(m->registers, job->initial, sizeof(m->registers));
+	job->ret = load_program(m, job->program);
+	if (job->ret == 0) {
+		run_threaded(m);
+		job->pc = m->pc;
+		memcpy(job->registers, m->registers, sizeof(job->registers));
+	}
+}
+
+/* Take the jobs of @batch in turn, and run them on a machine of the calling thread */
+static void* batch_worker(void* arg)
+{
+	struct batch* batch = arg;
+	struct machine m;
+	struct snapshot empty = { 0 };
+	int ret = machine_init(&m);
+
+	if (!ret) take_snapshot(&m, &empty);
+
+	while (true) {
+		size_t i;
+
+#ifndef _WIN32
+		pthread_mutex_lock(&batch->lock);
+#endif
+		i = batch->next++;
+#ifndef _WIN32
+		pthread_mutex_unlock(&batch->lock);
+#endif
+
+		if (i >= batch->nr_jobs) break;
+		if (ret) batch->jobs[i].ret = ret;
+		else run_batch_job(&m, &empty, &batch->jobs[i]);
+	}
+
+	drop_snapshot(&empty);
+	machine_exit(&m);
+	return NULL;
+}
+
+/***********************************************************************
+ * run_batch(batch, nr_threads)
+ *
+ * DESCRIPTION
+ *   Run the jobs of @batch with @nr_threads threads, the calling one
+ *   included, and wait for all of them to finish. The results are left
+ *   in the jobs. On Windows, the jobs run one after another on the
+ *   calling thread.
+ *
+ * RETURN VALUE
+ *   The number of threads the jobs ran on
+ */
+static int run_batch(struct batch* batch, int nr_threads)
+{
+#ifndef _WIN32
+	pthread_t* threads;
+	int started = 1;
+
+	if ((size_t)nr_threads > batch->nr_jobs) nr_threads = (int)batch->nr_jobs;
+	if (nr_threads < 1) nr_threads = 1;
+
+	batch->next = 0;
+	pthread_mutex_init(&batch->lock, NULL);
+
+	/* Threads that cannot be started leave their share to the others */
+	threads = calloc(nr_threads, sizeof(*threads));
+	for (int i = 1; threads && i < nr_threads; i++) {
+		if (pthread_create(&threads[started], NULL, batch_worker, batch) == 0) started++;
+	}
+	batch_worker(batch);
+
+	for (int i = 1; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	pthread_mutex_destroy(&batch->lock);
+
+	return started;
+#else
+	batch->next = 0;
+	batch_worker(batch);
+	return 1;
+#endif
+}
+
+
+/**********************************************************************
+ * Disassembler
+ *
+ * Turns machine words back into assembly in the syntax of the PA1
+ * assembler, so that the output can be assembled again into the same
+ * words. The decode tables below mirror the cases of process_instruction():
+ * R-format instructions are looked up by funct, and the others by opcode.
+ * Branch offsets are printed as they are encoded, and jump targets as the
+ * address the jump goes to. 'halt' and words that decode to nothing PA2
+ * executes are printed as such.
+ *
+ * Lines are formatted by hand into caller-provided buffers, without
+ * allocating and without going through printf().
+ */
+enum disasm_layout {
+	DISASM_NONE = 0,		/* Not an instruction PA2 executes */
+	DISASM_RD_RS_RT,		/* add rd rs rt */
+	DISASM_RD_RT_SHAMT,		/* sll rd rt shamt */
+	DISASM_RS,				/* jr rs */
+	DISASM_RT_RS_SIGNED,	/* addi rt rs immediate */
+	DISASM_RT_RS_UNSIGNED,	/* andi rt rs 0xmask */
+	DISASM_RT_UPPER,		/* lui rt 0xupper */
+	DISASM_RT_RS_OFFSET,	/* beq rt rs offset */
+	DISASM_TARGET,			/* j address */
+};
+
+struct disasm_desc {
+	const char* name;
+	unsigned char layout;
+};
+
+static const struct disasm_desc r_format_descs[64] = {
+	[0x20] = { "add",	DISASM_RD_RS_RT },
+	[0x22] = { "sub",	DISASM_RD_RS_RT },
+	[0x24] = { "and",	DISASM_RD_RS_RT },
+	[0x25] = { "or",	DISASM_RD_RS_RT },
+	[0x27] = { "nor",	DISASM_RD_RS_RT },
+	[0x00] = { "sll",	DISASM_RD_RT_SHAMT },
+	[0x02] = { "srl",	DISASM_RD_RT_SHAMT },
+	[0x03] = { "sra",	DISASM_RD_RT_SHAMT },
+	[0x2a] = { "slt",	DISASM_RD_RS_RT },
+	[0x08] = { "jr",	DISASM_RS },
+};
+
+static const struct disasm_desc opcode_descs[64] = {
+	[0x02] = { "j",		DISASM_TARGET },
+	[0x03] = { "jal",	DISASM_TARGET },
+	[0x08] = { "addi",	DISASM_RT_RS_SIGNED },
+	[0x0c] = { "andi",	DISASM_RT_RS_UNSIGNED },
+	[0x0d] = { "ori",	DISASM_RT_RS_UNSIGNED },
+	[0x0f] = { "lui",	DISASM_RT_UPPER },
+	[0x23] = { "lw",	DISASM_RT_RS_SIGNED },
+	[0x2b] = { "sw",	DISASM_RT_RS_SIGNED },
+	[0x0a] = { "slti",	DISASM_RT_RS_SIGNED },
+	[0x04] = { "beq",	DISASM_RT_RS_OFFSET },
+	[0x05] = { "bne",	DISASM_RT_RS_OFFSET },
+};
+
+/* Appends to a caller-provided buffer, dropping whatever does not fit */
+struct disasm_buf {
+	char* buf;
+	size_t size;
+	size_t len;
+};
+
+static inline void put_char(struct disasm_buf* b, char c)
+{
+	if (b->len < b->size) b->buf[b->len] = c;
+	b->len++;
+}
+
+static inline void put_str(struct disasm_buf* b, const char* str)
+{
+	while (*str) put_char(b, *str++);
+}
+
+static void put_dec(struct disasm_buf* b, int value)
+{
+	char digits[12];
+	int nr = 0;
+	unsigned int v = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+
+	if (value < 0) put_char(b, '-');
+	do {
+		digits[nr++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (nr) put_char(b, digits[--nr]);
+}
+
+/* The low @nr_digits hex digits of @value */
+static void put_hex_digits(struct disasm_buf* b, unsigned int value, int nr_digits)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	while (nr_digits--) put_char(b, hex[(value >> (4 * nr_digits)) & 0xf]);
+}
+
+static inline void put_hex(struct disasm_buf* b, unsigned int value, int nr_digits)
+{
+	put_str(b, "0x");
+	put_hex_digits(b, value, nr_digits);
+}
+
+static inline void put_reg(struct disasm_buf* b, unsigned int reg)
+{
+	put_char(b, ' ');
+	put_str(b, register_names[reg & 0x1f]);
+}
+
+static void format_instruction(struct disasm_buf* b, unsigned int instr, unsigned int addr)
+{
+	unsigned int opcode = instr >> 26;
+	unsigned int rs = (instr >> 21) & 0x1f;
+	unsigned int rt = (instr >> 16) & 0x1f;
+	unsigned int rd = (instr >> 11) & 0x1f;
+	const struct disasm_desc* desc = opcode ? &opcode_descs[opcode] : &r_format_descs[instr & 0x3f];
+
+	if (instr == 0xffffffff) {
+		put_str(b, "halt");
+		return;
+	}
+	if (instr == 0) { /* sll zr zr 0 */
+		put_str(b, "nop");
+		return;
+	}
+	if (desc->layout == DISASM_NONE) {
+		put_str(b, "unknown ");
+		put_hex(b, instr, 8);
+		return;
+	}
+
+	put_str(b, desc->name);
+
+	switch (desc->layout) {
+	case DISASM_RD_RS_RT:
+		put_reg(b, rd);
+		put_reg(b, rs);
+		put_reg(b, rt);
+		break;
+	case DISASM_RD_RT_SHAMT:
+		put_reg(b, rd);
+		put_reg(b, rt);
+		put_char(b, ' ');
+		put_dec(b, (instr >> 6) & 0x1f);
+		break;
+	case DISASM_RS:
+		put_reg(b, rs);
+		break;
+	case DISASM_RT_RS_SIGNED:
+	case DISASM_RT_RS_OFFSET:
+		put_reg(b, rt);
+		put_reg(b, rs);
+		put_char(b, ' ');
+		put_dec(b, (short)(instr & 0xffff));
+		break;
+	case DISASM_RT_RS_UNSIGNED:
+		put_reg(b, rt);
+		put_reg(b, rs);
+		put_char(b, ' ');
+		put_hex(b, instr & 0xffff, 4);
+		break;
+	case DISASM_RT_UPPER:
+		put_reg(b, rt);
+		put_char(b, ' ');
+		put_hex(b, instr & 0xffff, 4);
+		break;
+	case DISASM_TARGET:
+		put_char(b, ' ');
+		/* Where process_instruction() goes, which keeps the top 5 bits of the PC, not 4 */
+		put_hex(b, ((addr + 4) >> 27 << 27) | ((instr & 0x3ffffff) << 2), 8);
+		break;
+	}
+}
+
+/***********************************************************************
+ * disassemble(instr, addr, buf, size)
+ *
+ * DESCRIPTION
+ *   Format @instr, placed at @addr, into @buf as a NUL-terminated line of
+ *   assembly without a trailing newline. At most @size bytes are written.
+ *
+ * RETURN VALUE
+ *   The length of the whole line, like snprintf(). If it is @size or more,
+ *   the line is cut short.
+ */
+static size_t disassemble(unsigned int instr, unsigned int addr, char* buf, size_t size)
+{
+	struct disasm_buf b = { buf, size ? size - 1 : 0, 0 };
+
+	format_instruction(&b, instr, addr);
+	if (size) buf[b.len < size ? b.len : size - 1] = '\0';
+
+	return b.len;
+}
+
+/***********************************************************************
+ * disassemble_words(words, nr, addr, buf, size, len)
+ *
+ * DESCRIPTION
+ *   Disassemble the @nr big-endian words at @words, the first of which is
+ *   placed at @addr, into @buf, one line per word that looks like;
+ *
+ *     0x00001008:  01095020    add t2 t0 t1
+ *
+ *   @words may be a copy of the memory or a program image. The number of
+ *   bytes put into @buf goes to @len. Only whole lines are written, and
+ *   @buf is not NUL-terminated.
+ *
+ * RETURN VALUE
+ *   The number of words disassembled. It is less than @nr if @buf is full;
+ *   call again from there with an emptied buffer.
+ */
+static size_t disassemble_words(const unsigned char* words, size_t nr, unsigned int addr,
+	char* buf, size_t size, size_t* len)
+{
+	struct disasm_buf b = { buf, size, 0 };
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		const unsigned char* p = words + 4 * i;
+		unsigned int instr = get_be32(p);
+		size_t start = b.len;
+
+		put_hex(&b, addr + 4 * (unsigned int)i, 8);
+		put_str(&b, ":  ");
+		put_hex_digits(&b, instr, 8);
+		put_str(&b, "    ");
+		format_instruction(&b, instr, addr + 4 * (unsigned int)i);
+		put_char(&b, '\n');
+
+		if (b.len > b.size) {
+			b.len = start;
+			break;
+		}
+	}
+	*len = b.len;
+
+	return i;
+}
+
+
+#ifdef INPUT_ASSEMBLY
+/**********************************************************************
+ * Assembly input
+ *
+ * When PA2 is built with INPUT_ASSEMBLY defined, a command that is none of
+ * the commands below is taken as a line of assembly. It is assembled by
+ * the PA1 assembler, pseudo-instructions included, and executed.
+ *
+ * Replayed scripts repeat the same few instructions over and over, so the
+ * translations are memoized in a hash table keyed by the normalized text of
+ * the instruction, that is, its tokens in lowercase joined by single
+ * spaces. A repeated instruction then costs a hash and a string compare
+ * instead of the lookups, parsing, and encoding. The table is emptied when
+ * it gets half full, which keeps the probe sequences short.
+ */
+#define main pa1_main
+#include "../PA1/pa1.c"
+#undef main
+
+#define ASM_CACHE_SLOTS		4096	/* Must be a power of two */
+#define ASM_CACHE_KEY_LEN	64		/* Longer instructions are not cached */
+
+struct asm_cache_entry {
+	char key[ASM_CACHE_KEY_LEN];	/* "" if the slot is empty */
+	int nr_words;
+	unsigned int machine_code[MAX_EXPANSION];
+};
+
+static struct asm_cache_entry asm_cache[ASM_CACHE_SLOTS];
+
+static struct {
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long uncached;	/* Misses too long to be cached */
+	unsigned long long flushes;
+	unsigned int nr_entries;
+} asm_cache_stats;
+
+/**
+ * Lowercase @tokens in place, and join them into @key. Returns the length
+ * of @key, or 0 if it does not fit in ASM_CACHE_KEY_LEN.
+ */
+static size_t normalize_assembly(int nr_tokens, char* tokens[], char* key)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < nr_tokens; i++) {
+		for (char* p = tokens[i]; *p; p++) {
+			*p = tolower((unsigned char)*p);
+		}
+	}
+
+	for (int i = 0; i < nr_tokens; i++) {
+		size_t n = strlen(tokens[i]);
+
+		if (len + (i > 0) + n >= ASM_CACHE_KEY_LEN) return 0;
+		if (i > 0) key[len++] = ' ';
+		memcpy(key + len, tokens[i], n);
+		len += n;
+	}
+	key[len] = '\0';
+
+	return len;
+}
+
+static void asm_cache_clear(void)
+{
+	memset(asm_cache, 0, sizeof(asm_cache));
+	asm_cache_stats.nr_entries = 0;
+}
+
+/***********************************************************************
+ * assemble_cached(nr_tokens, tokens, machine_code)
+ *
+ * DESCRIPTION
+ *   translate() with memoization. @tokens are lowercased in place.
+ *
+ * RETURN VALUE
+ *   The same as translate(); the number of words put into @machine_code[],
+ *   or a negative errno. Failed translations are not cached.
+ */
+static int assemble_cached(int nr_tokens, char* tokens[], unsigned int machine_code[])
+{
+	char key[ASM_CACHE_KEY_LEN];
+	size_t len = normalize_assembly(nr_tokens, tokens, key);
+	struct asm_cache_entry* entry;
+	unsigned int hash = 2166136261u, i;
+	int ret;
+
+	if (!len) {
+		asm_cache_stats.misses++;
+		asm_cache_stats.uncached++;
+		return translate(nr_tokens, tokens, machine_code);
+	}
+
+	/* FNV-1a, then linear probing */
+	for (size_t j = 0; j < len; j++) {
+		hash = (hash ^ (unsigned char)key[j]) * 16777619u;
+	}
+	for (i = hash & (ASM_CACHE_SLOTS - 1); asm_cache[i].key[0]; i = (i + 1) & (ASM_CACHE_SLOTS - 1)) {
+		if (strcmp(asm_cache[i].key, key) == 0) {
+			asm_cache_stats.hits++;
+			memcpy(machine_code, asm_cache[i].machine_code, sizeof(asm_cache[i].machine_code));
+			return asm_cache[i].nr_words;
+		}
+	}
+	asm_cache_stats.misses++;
+
+	ret = translate(nr_tokens, tokens, machine_code);
+	if (ret < 0) return ret;
+
+	if (asm_cache_stats.nr_entries >= ASM_CACHE_SLOTS / 2) {
+		asm_cache_clear();
+		asm_cache_stats.flushes++;
+		i = hash & (ASM_CACHE_SLOTS - 1);
+	}
+
+	entry = &asm_cache[i];
+	memcpy(entry->key, key, len + 1);
+	entry->nr_words = ret;
+	memcpy(entry->machine_code, machine_code, ret * sizeof(*machine_code));
+	asm_cache_stats.nr_entries++;
+
+	return ret;
+}
+
+static void __show_asm_cache(void)
+{
+	unsigned long long lookups = asm_cache_stats.hits + asm_cache_stats.misses;
+
+	fprintf(stderr, "translation cache: %llu hits, %llu misses (%llu not cacheable), %.1f%% hit rate\n",
+		asm_cache_stats.hits, asm_cache_stats.misses, asm_cache_stats.uncached,
+		lookups ? 100.0 * asm_cache_stats.hits / lookups : 0.0);
+	fprintf(stderr, "                   %u / %u entries, %llu flushes\n",
+		asm_cache_stats.nr_entries, ASM_CACHE_SLOTS, asm_cache_stats.flushes);
+}
+#endif
+
+
+/*====================================================================*/
+/*          ****** DO NOT MODIFY ANYTHING FROM THIS LINE ******       */
+static void __show_registers(struct machine* m, char* const register_name)
+{
+	int from = 0, to = 0;
+	bool include_pc = false;
+
+	if (strmatch(register_name, "all")) {
+		from = 0;
+		to = 32;
+		include_pc = true;
+	}
+	else if (strmatch(register_name, "pc")) {
+		include_pc = true;
+	}
+	else {
+		for (int i = 0; i < sizeof(register_names) / sizeof(*register_names); i++) {
+			if (strmatch(register_name, register_names[i])) {
+				from = i;
+				to = i + 1;
+			}
+		}
+	}
+
+	for (int i = from; i < to; i++) {
+		fprintf(stderr, "[%02d:%2s] 0x%08x    %u\n", i, register_names[i], m->registers[i], m->registers[i]);
+	}
+	if (include_pc) {
+		fprintf(stderr, "[  pc ] 0x%08x\n", m->pc);
+	}
+}
+
+static void __dump_memory(struct machine* m, unsigned int addr, size_t length)
+{
 	for (size_t i = 0; i < length; i += 4) {
-		fprintf(stderr, "0x%08lx:  %02x %02x %02x %02x    %c %c %c %c\n",
-			addr + i,
-			memory[addr + i], memory[addr + i + 1],
-			memory[addr + i + 2], memory[addr + i + 3],
-			isprint(memory[addr + i]) ? memory[addr + i] : '.',
-			isprint(memory[addr + i + 1]) ? memory[addr + i + 1] : '.',
-			isprint(memory[addr + i + 2]) ? memory[addr + i + 2] : '.',
-			isprint(memory[addr + i + 3]) ? memory[addr + i + 3] : '.');
+		char assembly[64];
+		unsigned char bytes[4];
+
+		disassemble(load_word(&m->mem, addr + i), addr + i, assembly, sizeof(assembly));
+		for (unsigned int j = 0; j < 4; j++) bytes[j] = *memory_at(&m->mem, addr + i + j, false);
+		fprintf(stderr, "0x%08lx:  %02x %02x %02x %02x    %c %c %c %c    %s\n",
+			(unsigned long)(unsigned int)(addr + i),
+			bytes[0], bytes[1], bytes[2], bytes[3],
+			isprint(bytes[0]) ? bytes[0] : '.',
+			isprint(bytes[1]) ? bytes[1] : '.',
+			isprint(bytes[2]) ? bytes[2] : '.',
+			isprint(bytes[3]) ? bytes[3] : '.',
+			assembly);
+	}
+}
+
+/**
+ * Disassemble @nr words from @addr, or the program from its entry point up
+ * to the first 'halt' if @nr is 0. The search for the 'halt' gives up after
+ * as many words as the decoded table covers, rather than touch every page.
+ */
+static void __disassemble_memory(struct machine* m, unsigned int addr, size_t nr)
+{
+	static char buf[1 << 16];
+	unsigned char words[4 * 256];
+	unsigned long long max = (0x100000000ull - addr) / 4;	/* Up to the end of the address space */
+
+	if (nr == 0) {
+		size_t limit = max < NR_DECODED ? (size_t)max : NR_DECODED;
+
+		while (nr < limit && load_word(&m->mem, addr + 4 * (unsigned int)nr) != 0xffffffff) nr++;
+		if (nr < limit) nr++;
+	}
+	if (nr > max) nr = (size_t)max;
+
+	while (nr) {
+		size_t n = nr < sizeof(words) / 4 ? nr : sizeof(words) / 4, len, done;
+
+		for (size_t i = 0; i < n; i++) put_be32(words + 4 * i, load_word(&m->mem, addr + 4 * (unsigned int)i));
+		done = disassemble_words(words, n, addr, buf, sizeof(buf), &len);
+
+		fwrite(buf, 1, len, stderr);
+		addr += 4 * (unsigned int)done;
+		nr -= done;
+	}
+}
+
+/**
+ * The loop @run_program() had before the decoded table: fetch every word
+ * and hand it to process_instruction(). Returns the number of instructions
+ * it runs.
+ */
+static unsigned long long __run_reference(struct machine* m)
+{
+	unsigned long long nr = 0;
+
+	m->pc = m->entry_pc;
+	while (true) {
+		unsigned int instr = load_word(&m->mem, m->pc);
+
+		m->pc = m->pc + 4;
+		nr++;
+		if (!process_instruction(m, instr)) return nr;
+	}
+}
+
+/**
+ * Run the loaded program on each engine, starting over from the same
+ * registers and memory every time, and check that all of them end up in
+ * the same state as process_instruction() does
+ */
+static void __bench_engines(struct machine* m)
+{
+	static const char* const names[] = { "reference", "predecoded", "threaded", "jit" };
+	static struct snapshot initial, final;
+	unsigned long long nr = 0;
+
+	take_snapshot(m, &initial);
+
+	for (int i = 0; i < 4; i++) {
+		clock_t started;
+		double elapsed;
+
+		restore_snapshot(m, &initial);
+		flush_decoded(m);
+
+		started = clock();
+		if (i == 0) nr = __run_reference(m);
+		else if (i == 1) run_program(m);
+		else if (i == 2) run_threaded(m);
+		else run_jit(m);
+		elapsed = (double)(clock() - started) / CLOCKS_PER_SEC;
+
+		if (i == 0) take_snapshot(m, &final);
+		fprintf(stderr, "%-12s %12llu instructions %8.3f s %10.1f MIPS    %s\n", names[i], nr, elapsed,
+			elapsed > 0 ? nr / elapsed / 1e6 : 0.0,
+			m->pc == final.pc && !memcmp(m->registers, final.registers, sizeof(m->registers)) &&
+			same_pages(&m->mem.page_table, &final.pages) ? "ok" : "MISMATCH");
+	}
+	drop_snapshot(&initial);
+	drop_snapshot(&final);
+}
+
+/* Show how much of the memory the program has written */
+static void __show_memory(struct machine* m)
+{
+	fprintf(stderr, "%zu pages (%zu KB) allocated, %llu TLB misses, %llu pages copied on write\n",
+		m->mem.page_table.nr_pages, m->mem.page_table.nr_pages * PAGE_BYTES / 1024,
+		m->mem.tlb_misses, m->mem.cow_copies);
+}
+
+/**
+ * Run the jobs of @filename with @nr_threads threads, then show how each
+ * of them ended, in the order of the file; its pc and the registers it
+ * changed
+ */
+static void __run_batch(const char* filename, int nr_threads)
+{
+	struct batch batch;
+	struct timespec started, finished;
+	int ret = load_batch(&batch, filename);
+
+	if (ret) {
+		fprintf(stderr, "Cannot read jobs from %s: %s\n", filename, strerror(-ret));
+		release_batch(&batch);
+		return;
+	}
+
+	timespec_get(&started, TIME_UTC);
+	nr_threads = run_batch(&batch, nr_threads);
+	timespec_get(&finished, TIME_UTC);
+
+	for (size_t i = 0; i < batch.nr_jobs; i++) {
+		struct batch_job* job = &batch.jobs[i];
+
+		fprintf(stderr, "[%4zu] %s", i + 1, job->program);
+		if (job->ret) {
+			fprintf(stderr, "  %s\n", strerror(-job->ret));
+			continue;
+		}
+		fprintf(stderr, "  pc 0x%08x", job->pc);
+		for (int r = 0; r < 32; r++) {
+			if (job->registers[r] != job->initial[r]) {
+				fprintf(stderr, "  %s 0x%08x", register_names[r], job->registers[r]);
+			}
+		}
+		fprintf(stderr, "\n");
+	}
+	fprintf(stderr, "%zu jobs on %d thread%s in %.3f s\n", batch.nr_jobs, nr_threads, nr_threads > 1 ? "s" : "",
+		(finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9);
+
+	release_batch(&batch);
+}
+
+#define NR_HOTSPOTS	20	/* PCs the profile report shows */
+
+static int __compare_profile_entries(const void* a, const void* b)
+{
+	const struct profile_entry* x = *(const struct profile_entry* const*)a;
+	const struct profile_entry* y = *(const struct profile_entry* const*)b;
+
+	if (x->count != y->count) return x->count < y->count ? 1 : -1;
+	return x->pc < y->pc ? -1 : x->pc > y->pc;
+}
+
+/* The PCs of @p, the ones run most first. Returns NULL if they cannot be sorted */
+static const struct profile_entry** __sort_profile(const struct profile* p)
+{
+	const struct profile_entry** sorted = malloc((p->nr_entries + 1) * sizeof(*sorted));
+	size_t nr = 0;
+
+	if (!sorted) return NULL;
+	for (size_t i = 0; i < p->capacity; i++) {
+		if (p->entries[i].count) sorted[nr++] = &p->entries[i];
+	}
+	qsort(sorted, nr, sizeof(*sorted), __compare_profile_entries);
+	return sorted;
+}
+
+/* The instruction classes of @p that ran, the ones run most first, into @classes. Returns how many */
+static int __sort_profile_classes(const struct profile* p, int classes[128])
+{
+	int nr = 0;
+
+	for (int c = 0; c < 128; c++) {
+		int i;
+
+		if (!p->classes[c]) continue;
+		for (i = nr++; i > 0 && p->classes[classes[i - 1]] < p->classes[c]; i--) classes[i] = classes[i - 1];
+		classes[i] = c;
+	}
+	return nr;
+}
+
+static const char* __profile_class_name(int c)
+{
+	const struct disasm_desc* desc = c < 64 ? &opcode_descs[c] : &r_format_descs[c - 64];
+
+	return desc->name ? desc->name : "unknown";
+}
+
+static double __share(unsigned long long count, unsigned long long total)
+{
+	return total ? 100.0 * count / total : 0.0;
+}
+
+/* Write everything in the profile of @m to @filename as CSV, one row per PC and per instruction class */
+static int __write_profile_csv(struct machine* m, const char* filename)
+{
+	const struct profile* p = m->profile;
+	const struct profile_entry** sorted = __sort_profile(p);
+	int classes[128], nr_classes = __sort_profile_classes(p, classes);
+	FILE* out;
+
+	if (!sorted) return -ENOMEM;
+	out = fopen(filename, "w");
+	if (!out) {
+		free(sorted);
+		return -errno;
+	}
+
+	fprintf(out, "kind,pc,instruction,count,percent,taken,not_taken\n");
+	for (size_t i = 0; i < p->nr_entries; i++) {
+		const struct profile_entry* e = sorted[i];
+		unsigned int opcode = e->instr >> 26;
+		char assembly[64];
+
+		disassemble(e->instr, e->pc, assembly, sizeof(assembly));
+		fprintf(out, "pc,0x%08x,%s,%llu,%.3f,", e->pc, assembly, e->count, __share(e->count, p->nr_instructions));
+		if (opcode == 0x04 || opcode == 0x05) fprintf(out, "%llu,%llu\n", e->taken, e->count - e->taken);
+		else fprintf(out, ",\n");
+	}
+	for (int i = 0; i < nr_classes; i++) {
+		fprintf(out, "class,,%s,%llu,%.3f,,\n", __profile_class_name(classes[i]),
+			p->classes[classes[i]], __share(p->classes[classes[i]], p->nr_instructions));
+	}
+	fprintf(out, "total,,,%llu,100.000,%llu,%llu\n", p->nr_instructions, p->taken, p->branches - p->taken);
+
+	free(sorted);
+	return fclose(out) ? -errno : 0;
+}
+
+/**
+ * Show the profile of the last run of @m; the PCs run the most with their
+ * instructions, and the instructions that ran by class. Then write it to
+ * the CSV file given to 'profile on', if any.
+ */
+static void __show_profile(struct machine* m)
+{
+	const struct profile* p = m->profile;
+	const struct profile_entry** sorted = __sort_profile(p);
+	int classes[128], nr_classes = __sort_profile_classes(p, classes);
+	unsigned long long total = p->nr_instructions;
+
+	fprintf(stderr, "%llu instructions at %zu PCs\n", total, p->nr_entries);
+	fprintf(stderr, "%llu branches, %llu taken and %llu not taken; %llu loads, %llu stores\n",
+		p->branches, p->taken, p->branches - p->taken, p->loads, p->stores);
+
+	if (sorted) {
+		fprintf(stderr, "\n%-10s  %14s  %7s  %12s  %12s    %s\n", "pc", "count", "%", "taken", "not taken", "instruction");
+		for (size_t i = 0; i < p->nr_entries && i < NR_HOTSPOTS; i++) {
+			const struct profile_entry* e = sorted[i];
+			unsigned int opcode = e->instr >> 26;
+			char assembly[64];
+
+			disassemble(e->instr, e->pc, assembly, sizeof(assembly));
+			fprintf(stderr, "0x%08x  %14llu  %6.2f%%", e->pc, e->count, __share(e->count, total));
+			if (opcode == 0x04 || opcode == 0x05) fprintf(stderr, "  %12llu  %12llu", e->taken, e->count - e->taken);
+			else fprintf(stderr, "  %12s  %12s", "", "");
+			fprintf(stderr, "    %s\n", assembly);
+		}
+		free(sorted);
+	}
+
+	fprintf(stderr, "\n%-10s  %14s  %7s\n", "class", "count", "%");
+	for (int i = 0; i < nr_classes; i++) {
+		fprintf(stderr, "%-10s  %14llu  %6.2f%%\n", __profile_class_name(classes[i]),
+			p->classes[classes[i]], __share(p->classes[classes[i]], total));
+	}
+
+	if (p->csv[0]) {
+		int ret = __write_profile_csv(m, p->csv);
+
+		if (ret) fprintf(stderr, "Cannot write the profile to %s: %s\n", p->csv, strerror(-ret));
+	}
+}
+
+/* The machine the commands work on */
+static struct machine machine;
+
+/* The machine state the 'snapshot' command saves and 'restore' goes back to */
+static struct snapshot saved_state;
+static bool has_saved_state;
+
+/**
+ * Show which superinstructions the last run of 'run' or 'run fast' ran,
+ * and how many dispatches they saved, or turn fusion on or off
+ */
+static void __show_fusion(struct machine* m)
+{
+	unsigned long long saved = 0;
+
+	fprintf(stderr, "fusion %s\n", m->fusion_enabled ? "on" : "off");
+	fprintf(stderr, "%-12s %8s %14s %16s\n", "sequence", "sites", "runs", "dispatches saved");
+	for (size_t f = 0; f < NR_FUSIONS; f++) {
+		fprintf(stderr, "%-12s %8zu %14llu %16llu\n", fusions[f].name, m->fusion_sites[f], m->fusion_counts[f],
+			m->fusion_counts[f] * (fusions[f].nr_ops - 1));
+		saved += m->fusion_counts[f] * (fusions[f].nr_ops - 1);
 	}
+	fprintf(stderr, "%-12s %8s %14s %16llu\n", "total", "", "", saved);
 }
 
 static void __process_command(int argc, char* argv[])
@@ -416,7 +3033,7 @@ static void __process_command(int argc, char* argv[])
 
 	if (strmatch(argv[0], "load")) {
 		if (argc == 2) {
-			load_program(argv[1]);
+			load_program(&machine, argv[1]);
 		}
 		else {
 			printf("Usage: load [program filename]\n");
@@ -424,40 +3041,171 @@ static void __process_command(int argc, char* argv[])
 	}
 	else if (strmatch(argv[0], "run")) {
 		if (argc == 1) {
-			run_program();
+			run_program(&machine);
+			if (machine.profile) __show_profile(&machine);
+		}
+		else if (argc == 2 && strmatch(argv[1], "fast")) {
+			run_threaded(&machine);
+		}
+		else if (argc == 2 && strmatch(argv[1], "jit")) {
+			run_jit(&machine);
+		}
+		else {
+			printf("Usage: run { fast | jit }\n");
+		}
+	}
+	else if (strmatch(argv[0], "profile")) {
+		if ((argc == 2 || argc == 3) && strmatch(argv[1], "on")) {
+			if (!machine.profile && !(machine.profile = calloc(1, sizeof(*machine.profile)))) {
+				printf("Out of memory for the profile\n");
+				return;
+			}
+			snprintf(machine.profile->csv, sizeof(machine.profile->csv), "%s", argc == 3 ? argv[2] : "");
+		}
+		else if (argc == 2 && strmatch(argv[1], "off")) {
+			release_profile(machine.profile);
+			machine.profile = NULL;
+		}
+		else if (argc == 1 && machine.profile) {
+			__show_profile(&machine);
+		}
+		else if (argc == 1) {
+			printf("Profiling is off\n");
+		}
+		else {
+			printf("Usage: profile { on { [csv filename] } | off }\n");
+		}
+	}
+	else if (strmatch(argv[0], "fusion")) {
+		if (argc == 1) {
+			__show_fusion(&machine);
+		}
+		else if (argc == 2 && (strmatch(argv[1], "on") || strmatch(argv[1], "off"))) {
+			machine.fusion_enabled = strmatch(argv[1], "on");
+			flush_decoded(&machine);
+			memset(machine.fusion_counts, 0, sizeof(machine.fusion_counts));
+			memset(machine.fusion_sites, 0, sizeof(machine.fusion_sites));
+		}
+		else {
+			printf("Usage: fusion { on | off }\n");
+		}
+	}
+	else if (strmatch(argv[0], "snapshot")) {
+		if (argc == 1) {
+			if (has_saved_state) drop_snapshot(&saved_state);
+			take_snapshot(&machine, &saved_state);
+			has_saved_state = true;
+		}
+		else {
+			printf("Usage: snapshot\n");
+		}
+	}
+	else if (strmatch(argv[0], "restore")) {
+		if (argc == 1 && has_saved_state) {
+			restore_snapshot(&machine, &saved_state);
+		}
+		else if (argc == 1) {
+			printf("No snapshot to restore\n");
+		}
+		else {
+			printf("Usage: restore\n");
+		}
+	}
+	else if (strmatch(argv[0], "memory")) {
+		if (argc == 1) {
+			__show_memory(&machine);
+		}
+		else {
+			printf("Usage: memory\n");
+		}
+	}
+	else if (strmatch(argv[0], "bench")) {
+		if (argc == 1) {
+			__bench_engines(&machine);
+		}
+		else {
+			printf("Usage: bench\n");
+		}
+	}
+	else if (strmatch(argv[0], "batch")) {
+		if (argc == 2 || argc == 3) {
+			long nr_threads = argc == 3 ? strtol(argv[2], NULL, 0) : 1;
+
+#ifdef _WIN32
+			if (nr_threads > 1) printf("Threads are not supported on this platform; running the jobs one by one\n");
+#else
+			if (argc == 2) nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+			__run_batch(argv[1], nr_threads > 0 ? (int)nr_threads : 1);
 		}
 		else {
-			printf("Usage: run\n");
+			printf("Usage: batch [job filename] { [number of threads] }\n");
 		}
 	}
 	else if (strmatch(argv[0], "show")) {
 		if (argc == 1) {
-			__show_registers("all");
+			__show_registers(&machine, "all");
 		}
 		else if (argc == 2) {
-			__show_registers(argv[1]);
+			__show_registers(&machine, argv[1]);
 		}
 		else {
 			printf("Usage: show { [register name] }\n");
 		}
 	}
+	else if (strmatch(argv[0], "disasm")) {
+		if (argc == 1) {
+			__disassemble_memory(&machine, machine.entry_pc, 0);
+		}
+		else if (argc == 3) {
+			__disassemble_memory(&machine, strtoimax(argv[1], NULL, 0), strtoimax(argv[2], NULL, 0));
+		}
+		else {
+			printf("Usage: disasm { [start address] [number of instructions] }\n");
+		}
+	}
 	else if (strmatch(argv[0], "dump")) {
 		if (argc == 3) {
-			__dump_memory(strtoimax(argv[1], NULL, 0), strtoimax(argv[2], NULL, 0));
+			__dump_memory(&machine, strtoimax(argv[1], NULL, 0), strtoimax(argv[2], NULL, 0));
 		}
 		else {
 			printf("Usage: dump [start address] [length]\n");
 		}
 	}
+#ifdef INPUT_ASSEMBLY
+	else if (strmatch(argv[0], "cache")) {
+		if (argc == 1) {
+			__show_asm_cache();
+		}
+		else if (argc == 2 && strmatch(argv[1], "clear")) {
+			asm_cache_clear();
+		}
+		else {
+			printf("Usage: cache { clear }\n");
+		}
+	}
+#endif
 	else {
 #ifdef INPUT_ASSEMBLY
-		/**
-		 * You may hook up @translate() from pa1 here to allow assembly code input!
-		 */
-		unsigned int instr = translate(argc, argv);
-		process_instruction(instr);
+		unsigned int machine_code[MAX_EXPANSION];
+		int nr_words;
+
+		/* Machine code can still be put in as it is */
+		if (isdigit((unsigned char)argv[0][0])) {
+			process_instruction(&machine, strtoimax(argv[0], NULL, 0));
+			return;
+		}
+
+		nr_words = assemble_cached(argc, argv, machine_code);
+		if (nr_words < 0) {
+			printf("%s: %s\n", translate_error(nr_words), argv[0]);
+			return;
+		}
+		for (int i = 0; i < nr_words; i++) {
+			process_instruction(&machine, machine_code[i]);
+		}
 #else
-		process_instruction(strtoimax(argv[0], NULL, 0));
+		process_instruction(&machine, strtoimax(argv[0], NULL, 0));
 #endif
 	}
 }
@@ -499,6 +3247,11 @@ int main(int argc, char* const argv[])
 	char command[MAX_COMMAND] = { '\0' };
 	FILE* input = stdin;
 
+	if (machine_init(&machine)) {
+		fprintf(stderr, "Cannot set up the machine\n");
+		return EXIT_FAILURE;
+	}
+
 	if (argc > 1) {
 		input = fopen(argv[1], "r");
 		if (!input) {